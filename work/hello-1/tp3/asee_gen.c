@@ -0,0 +1,468 @@
+/*
+ * asee_gen.c - traffic generator for asee_mod: kernel threads, pinned to
+ * chosen CPUs, that write records straight into a channel, so that the
+ * read side can be loaded without the cost of write() on the other side.
+ *
+ * Configured in /sys/kernel/asee_gen, started and stopped with its run
+ * file.
+ */
+
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/kernel.h> /* for sprintf() */
+#include <linux/kobject.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/printk.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/topology.h>
+#include <linux/types.h>
+#include <linux/version.h>
+
+#include "asee_kernel.h"
+
+/* Largest record */
+#define ASEE_GEN_SIZE_MAX (64 * 1024)
+/* How long a producer backs off when the channel is full */
+#define ASEE_GEN_STALL_US 20
+
+/* A producer thread, and what it did in its last run */
+struct asee_gen_producer {
+    struct task_struct *task;
+    int cpu;
+    char *buf;               /* records are taken from there */
+    atomic_long_t records;
+    atomic_long_t bytes;
+    atomic_long_t stalls;    /* times the channel was found full */
+    atomic64_t stall_ns;     /* time spent waiting for room */
+    atomic_long_t errors;
+};
+
+/* Configuration, under gen_lock. The rate and the sizes can be changed
+ * while running.
+ */
+static DEFINE_MUTEX(gen_lock);
+static char gen_channel[16] = "asee_mod";
+static cpumask_var_t gen_cpus;
+static unsigned int gen_rate;      /* records/s per producer, 0 flat out */
+static unsigned int gen_size_min = 64;
+static unsigned int gen_size_max = 64;
+
+/* Current (or last) run */
+static struct asee_channel *gen_chan;
+static struct asee_gen_producer *producers;
+static int nr_producers;
+static bool running;
+static u64 start_ns;
+static u64 stop_ns;
+
+static struct kobject *asee_gen_kobj;
+
+/* Record size, uniform between the min and max sizes */
+static unsigned int asee_gen_size(void)
+{
+    unsigned int min = READ_ONCE(gen_size_min);
+    unsigned int max = READ_ONCE(gen_size_max);
+
+    if (max <= min)
+        return min;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+    return min + get_random_u32_below(max - min + 1);
+#else
+    return min + prandom_u32_max(max - min + 1);
+#endif
+}
+
+/* Write one record whole, backing off while the channel is full */
+static int asee_gen_write(struct asee_gen_producer *p, size_t size)
+{
+    size_t done = 0;
+    ssize_t n;
+    u64 start;
+
+    while (done < size) {
+        n = asee_kernel_write(gen_chan, p->buf + done, size - done, true);
+        if (n > 0) {
+            done += n;
+            continue;
+        }
+        if (n != -EAGAIN)
+            return n;
+        if (kthread_should_stop())
+            return -EINTR;
+
+        /* Backpressure from the readers */
+        start = ktime_get_ns();
+        atomic_long_inc(&p->stalls);
+        usleep_range(ASEE_GEN_STALL_US, 2 * ASEE_GEN_STALL_US);
+        atomic64_add(ktime_get_ns() - start, &p->stall_ns);
+    }
+    return 0;
+}
+
+static int asee_gen_thread(void *data)
+{
+    struct asee_gen_producer *p = data;
+    u64 next = ktime_get_ns(), now;
+    unsigned int size, rate;
+    ktime_t kt;
+    int error;
+
+    while (!kthread_should_stop()) {
+        size = asee_gen_size();
+        p->buf[size - 1] = '\n';
+        error = asee_gen_write(p, size);
+        p->buf[size - 1] = 'x';
+        if (error == -EINTR)
+            break;
+        if (error) {
+            atomic_long_inc(&p->errors);
+            msleep(10);
+            continue;
+        }
+        atomic_long_inc(&p->records);
+        atomic_long_add(size, &p->bytes);
+
+        rate = READ_ONCE(gen_rate);
+        if (!rate) {
+            cond_resched();
+            continue;
+        }
+        /* Paced: sleep until the next record is due, and do not try to
+         * catch up on more than a second of lateness.
+         */
+        next += div_u64(NSEC_PER_SEC, rate);
+        now = ktime_get_ns();
+        if (now > next + NSEC_PER_SEC)
+            next = now;
+        if (next > now) {
+            kt = ns_to_ktime(next);
+            set_current_state(TASK_INTERRUPTIBLE);
+            schedule_hrtimeout_range(&kt, 0, HRTIMER_MODE_ABS);
+        }
+    }
+    return 0;
+}
+
+static void asee_gen_free(void)
+{
+    int i;
+
+    for (i = 0; i < nr_producers; i++)
+        kfree(producers[i].buf);
+    kfree(producers);
+    producers = NULL;
+    nr_producers = 0;
+}
+
+static void asee_gen_stop(void)
+{
+    int i;
+
+    for (i = 0; i < nr_producers; i++)
+        kthread_stop(producers[i].task);
+    stop_ns = ktime_get_ns();
+    running = false;
+}
+
+/* Start a producer on each online CPU of gen_cpus */
+static int asee_gen_start(void)
+{
+    struct asee_gen_producer *p;
+    int cpu, error = 0;
+
+    gen_chan = asee_channel_find(gen_channel);
+    if (!gen_chan)
+        return -ENODEV;
+
+    asee_gen_free();
+    producers = kcalloc(cpumask_weight(gen_cpus), sizeof(*producers),
+                        GFP_KERNEL);
+    if (!producers)
+        return -ENOMEM;
+
+    cpus_read_lock();
+    for_each_cpu_and(cpu, gen_cpus, cpu_online_mask) {
+        p = &producers[nr_producers];
+        p->cpu = cpu;
+        p->buf = kmalloc_node(ASEE_GEN_SIZE_MAX, GFP_KERNEL,
+                              cpu_to_node(cpu));
+        if (!p->buf) {
+            error = -ENOMEM;
+            break;
+        }
+        memset(p->buf, 'x', ASEE_GEN_SIZE_MAX);
+        p->task = kthread_create(asee_gen_thread, p, "asee_gen/%d", cpu);
+        if (IS_ERR(p->task)) {
+            error = PTR_ERR(p->task);
+            kfree(p->buf);
+            break;
+        }
+        kthread_bind(p->task, cpu);
+        nr_producers++;
+    }
+    cpus_read_unlock();
+
+    if (!nr_producers && !error)
+        error = -EINVAL;
+    if (error) {
+        /* The threads were not woken, they stop before running */
+        asee_gen_stop();
+        asee_gen_free();
+        return error;
+    }
+
+    start_ns = ktime_get_ns();
+    running = true;
+    for (cpu = 0; cpu < nr_producers; cpu++)
+        wake_up_process(producers[cpu].task);
+    return 0;
+}
+
+static ssize_t run_show(struct kobject *kobj, struct kobj_attribute *attr,
+                        char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(running));
+}
+
+static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
+                         const char *buf, size_t count)
+{
+    bool run;
+    int error = 0;
+
+    if (kstrtobool(buf, &run))
+        return -EINVAL;
+
+    mutex_lock(&gen_lock);
+    if (run && !running)
+        error = asee_gen_start();
+    else if (!run && running)
+        asee_gen_stop();
+    mutex_unlock(&gen_lock);
+    return error ? error : count;
+}
+
+static struct kobj_attribute run_attribute =
+  __ATTR(run, 0660, run_show, run_store);
+
+/* Channel written to, by name */
+static ssize_t channel_show(struct kobject *kobj,
+                            struct kobj_attribute *attr, char *buf)
+{
+    ssize_t len;
+
+    mutex_lock(&gen_lock);
+    len = sprintf(buf, "%s\n", gen_channel);
+    mutex_unlock(&gen_lock);
+    return len;
+}
+
+static ssize_t channel_store(struct kobject *kobj,
+                             struct kobj_attribute *attr,
+                             const char *buf, size_t count)
+{
+    char name[sizeof(gen_channel)];
+
+    if (strscpy(name, buf, sizeof(name)) < 0)
+        return -EINVAL;
+    strim(name);
+    if (!asee_channel_find(name))
+        return -ENODEV;
+
+    mutex_lock(&gen_lock);
+    if (running) {
+        mutex_unlock(&gen_lock);
+        return -EBUSY;
+    }
+    strscpy(gen_channel, name, sizeof(gen_channel));
+    mutex_unlock(&gen_lock);
+    return count;
+}
+
+static struct kobj_attribute channel_attribute =
+  __ATTR(channel, 0660, channel_show, channel_store);
+
+/* CPUs to run a producer on, as a list ("0-3,6") */
+static ssize_t cpus_show(struct kobject *kobj, struct kobj_attribute *attr,
+                         char *buf)
+{
+    ssize_t len;
+
+    mutex_lock(&gen_lock);
+    len = sprintf(buf, "%*pbl\n", cpumask_pr_args(gen_cpus));
+    mutex_unlock(&gen_lock);
+    return len;
+}
+
+static ssize_t cpus_store(struct kobject *kobj, struct kobj_attribute *attr,
+                          const char *buf, size_t count)
+{
+    cpumask_var_t mask;
+    int error;
+
+    if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+        return -ENOMEM;
+    error = cpulist_parse(buf, mask);
+    if (!error && cpumask_empty(mask))
+        error = -EINVAL;
+
+    mutex_lock(&gen_lock);
+    if (!error && running)
+        error = -EBUSY;
+    if (!error)
+        cpumask_copy(gen_cpus, mask);
+    mutex_unlock(&gen_lock);
+    free_cpumask_var(mask);
+    return error ? error : count;
+}
+
+static struct kobj_attribute cpus_attribute =
+  __ATTR(cpus, 0660, cpus_show, cpus_store);
+
+/* Records per second of each producer, 0 to write flat out */
+static ssize_t rate_show(struct kobject *kobj, struct kobj_attribute *attr,
+                         char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(gen_rate));
+}
+
+static ssize_t rate_store(struct kobject *kobj, struct kobj_attribute *attr,
+                          const char *buf, size_t count)
+{
+    unsigned int rate;
+
+    if (kstrtouint(buf, 0, &rate))
+        return -EINVAL;
+    WRITE_ONCE(gen_rate, rate);
+    return count;
+}
+
+static struct kobj_attribute rate_attribute =
+  __ATTR(rate, 0660, rate_show, rate_store);
+
+/* Record sizes: "min max" (uniform in between), or one size for all */
+static ssize_t size_show(struct kobject *kobj, struct kobj_attribute *attr,
+                         char *buf)
+{
+    return sprintf(buf, "%u %u\n", READ_ONCE(gen_size_min),
+                   READ_ONCE(gen_size_max));
+}
+
+static ssize_t size_store(struct kobject *kobj, struct kobj_attribute *attr,
+                          const char *buf, size_t count)
+{
+    unsigned int lo, hi;
+    int n = sscanf(buf, "%u %u", &lo, &hi);
+
+    if (n == 1)
+        hi = lo;
+    else if (n != 2)
+        return -EINVAL;
+    if (!lo || lo > hi || hi > ASEE_GEN_SIZE_MAX)
+        return -EINVAL;
+
+    /* The producers read them apart, and take lo if they cross */
+    WRITE_ONCE(gen_size_min, lo);
+    WRITE_ONCE(gen_size_max, hi);
+    return count;
+}
+
+static struct kobj_attribute size_attribute =
+  __ATTR(size, 0660, size_show, size_store);
+
+/* What each producer of the current (or last) run achieved */
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr,
+                          char *buf)
+{
+    struct asee_gen_producer *p;
+    u64 elapsed_ms;
+    long records, bytes;
+    int len, i;
+
+    mutex_lock(&gen_lock);
+    elapsed_ms = div_u64((running ? ktime_get_ns() : stop_ns) - start_ns,
+                         NSEC_PER_MSEC);
+    len = sprintf(buf, "cpu records bytes records_s bytes_s stalls "
+                  "stall_us errors\n");
+    for (i = 0; i < nr_producers; i++) {
+        p = &producers[i];
+        records = atomic_long_read(&p->records);
+        bytes = atomic_long_read(&p->bytes);
+        len += scnprintf(buf + len, PAGE_SIZE - len,
+                         "%d %ld %ld %llu %llu %ld %llu %ld\n", p->cpu,
+                         records, bytes,
+                         elapsed_ms ? div64_u64(records * 1000ULL, elapsed_ms) : 0,
+                         elapsed_ms ? div64_u64(bytes * 1000ULL, elapsed_ms) : 0,
+                         atomic_long_read(&p->stalls),
+                         (u64)atomic64_read(&p->stall_ns) / NSEC_PER_USEC,
+                         atomic_long_read(&p->errors));
+    }
+    mutex_unlock(&gen_lock);
+    return len;
+}
+
+static struct kobj_attribute stats_attribute =
+  __ATTR(stats, 0440, stats_show, NULL);
+
+static struct attribute *asee_gen_attrs[] = {
+    &run_attribute.attr,
+    &channel_attribute.attr,
+    &cpus_attribute.attr,
+    &rate_attribute.attr,
+    &size_attribute.attr,
+    &stats_attribute.attr,
+    NULL,
+};
+
+static const struct attribute_group asee_gen_group = {
+    .attrs = asee_gen_attrs,
+};
+
+static int __init asee_gen_init(void)
+{
+    int error;
+
+    if (!zalloc_cpumask_var(&gen_cpus, GFP_KERNEL))
+        return -ENOMEM;
+    cpumask_set_cpu(cpumask_first(cpu_online_mask), gen_cpus);
+
+    asee_gen_kobj = kobject_create_and_add("asee_gen", kernel_kobj);
+    if (!asee_gen_kobj) {
+        free_cpumask_var(gen_cpus);
+        return -ENOMEM;
+    }
+    error = sysfs_create_group(asee_gen_kobj, &asee_gen_group);
+    if (error) {
+        kobject_put(asee_gen_kobj);
+        free_cpumask_var(gen_cpus);
+        return error;
+    }
+    pr_info("asee_gen: initialised\n");
+    return 0;
+}
+
+static void __exit asee_gen_exit(void)
+{
+    kobject_put(asee_gen_kobj);
+    mutex_lock(&gen_lock);
+    if (running)
+        asee_gen_stop();
+    asee_gen_free();
+    mutex_unlock(&gen_lock);
+    free_cpumask_var(gen_cpus);
+}
+
+module_init(asee_gen_init);
+module_exit(asee_gen_exit);
+
+MODULE_LICENSE("GPL");
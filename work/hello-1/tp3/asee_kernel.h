@@ -0,0 +1,74 @@
+/*
+ * asee_kernel.h - interface of asee_mod for other kernel modules, which
+ * feed a channel without going through /dev/asee_mod.
+ */
+
+#ifndef ASEE_KERNEL_H
+#define ASEE_KERNEL_H
+
+#include <linux/types.h>
+
+struct asee_channel;
+
+/* The channel called name ("asee_mod", "asee_mod1", ...), or NULL. The
+ * channels live as long as asee_mod, which the caller holds by using it.
+ */
+struct asee_channel *asee_channel_find(const char *name);
+
+/* Write len bytes from kernel memory, as write() on the device does.
+ * Returns the number of bytes consumed (stored, or dropped by the overflow
+ * policy), -EAGAIN if nonblock is set and the channel is full, or another
+ * error. Blocking waits are interruptible, so kthreads should use nonblock.
+ */
+ssize_t asee_kernel_write(struct asee_channel *ch, const void *buf,
+                          size_t len, bool nonblock);
+
+/* Queue len bytes from any context, hard interrupt handlers included: it
+ * never sleeps nor waits for the readers. The bytes are staged on the
+ * current CPU (at most 2 KiB per CPU until they are moved), and reach the
+ * channel, in order for each CPU, from a workqueue soon after. What does
+ * not fit in the stage is counted as dropped, and -ENOSPC returned.
+ */
+int asee_irq_produce(struct asee_channel *ch, const void *data, size_t len);
+
+/*
+ * Zero-copy access to the ring of a channel. A producer reserves len
+ * bytes, builds its record at data (contiguous, even across the end of
+ * the ring), and commits it; a consumer peeks at up to len stored bytes,
+ * uses them in place, and releases them. Between the two calls the caller
+ * holds the channel: it must not sleep, and must get to the commit or
+ * release soon, as the other transfers are held back until then. The
+ * whole of a reservation is committed.
+ *
+ * They may be called from process context, or with atomic set from any
+ * atomic context but hard interrupts. In atomic context they fail with
+ * -EAGAIN rather than wait for a resize, -ENODATA while the channel has no
+ * ring yet, and -EOPNOTSUPP on a channel with the mutex backend (asee_sync).
+ * Other errors: -EAGAIN when the ring is full (or, for asee_peek(), empty),
+ * -EMSGSIZE when len is larger than the channel, -EOPNOTSUPP on elastic
+ * channels. On a full ring, the overwrite-oldest policy makes room, and
+ * drop-newest counts the record as dropped and fails with -ENOBUFS: the
+ * record is gone, it must not be reserved again.
+ */
+struct asee_resv {
+    void *data;
+    size_t len;
+    unsigned long pos; /* private */
+};
+
+int asee_reserve(struct asee_channel *ch, size_t len, bool atomic,
+                 struct asee_resv *r);
+void asee_commit(struct asee_channel *ch, struct asee_resv *r);
+int asee_peek(struct asee_channel *ch, size_t len, bool atomic,
+              struct asee_resv *r);
+void asee_release(struct asee_channel *ch, struct asee_resv *r);
+
+/* Sleep until asee_reserve() (write set) or asee_peek() of len bytes may
+ * succeed, at most timeout_us (0 for no limit). Returns 0, -ETIME,
+ * -ERESTARTSYS on a signal, or -ECONNABORTED if the waits of the channel
+ * were aborted. Another task may take the room or the data first.
+ */
+int asee_kernel_wait(struct asee_channel *ch, bool write, size_t len,
+                     unsigned int timeout_us);
+
+#endif
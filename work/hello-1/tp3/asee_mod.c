@@ -7,53 +7,663 @@
 #include <linux/cdev.h>
 #include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/cgroup.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
+#include <linux/highmem.h>
+#include <linux/huge_mm.h>
 #include <linux/init.h>
+#include <linux/irq_work.h>
 #include <linux/kernel.h> /* for sprintf() */
+#include <linux/kref.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/nodemask.h>
+#include <linux/pagemap.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/poll.h>
 #include <linux/printk.h>
+#include <linux/proc_fs.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/shmem_fs.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/splice.h>
 #include <linux/types.h>
 #include <linux/uaccess.h> /* for get_user and put_user */
 #include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+#include <linux/vmalloc.h>
 #include <linux/kobject.h>
+#include <linux/math64.h>
 #include <linux/string.h>
 #include <linux/sysfs.h>
 #include <asm/errno.h>
 #include <linux/wait.h> /* For putting processes to sleep and
                                    waking them up */
+#include <linux/workqueue.h>
+
+#include "asee_kernel.h"
+#include "asee_mod.h"
 
 /*  Prototypes - this would normally go in a .h file */
 static int device_open(struct inode *, struct file *);
 static int device_release(struct inode *, struct file *);
-static ssize_t device_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t device_write(struct file *, const char __user *, size_t,
-                            loff_t *);
-static int controlCcheck(void);
-//static void emptybuffer(char *buffer, int buffer_length);
+static ssize_t device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t device_write_iter(struct kiocb *, struct iov_iter *);
+static __poll_t device_poll(struct file *, poll_table *);
+static long device_ioctl(struct file *, unsigned int, unsigned long);
+static int device_flush(struct file *, fl_owner_t);
+static int device_fsync(struct file *, loff_t, loff_t, int);
+static int device_mmap(struct file *, struct vm_area_struct *);
+static ssize_t device_splice_write(struct pipe_inode_info *, struct file *,
+                                   loff_t *, size_t, unsigned int);
+static ssize_t device_splice_read(struct file *, loff_t *,
+                                  struct pipe_inode_info *, size_t,
+                                  unsigned int);
+static unsigned long device_get_unmapped_area(struct file *, unsigned long,
+                                              unsigned long, unsigned long,
+                                              unsigned long);
 
 #define SUCCESS 0
 #define DEVICE_NAME "asee_mod" /* Dev name as it appears in /proc/devices   */
 #define BUF_LEN 16 /* Max length of the message from the device */
 #define DEFALUT_VAL 1 /* Max length of the message from the device */
+#define ASEE_MAX_CHANNELS 16
+/* Largest transfer done in one reservation, with preemption disabled */
+#define ASEE_MAX_CHUNK (16 * PAGE_SIZE)
+/* Size of the chunks of elastic channels, header included */
+#define ASEE_CHUNK_SIZE PAGE_SIZE
+/* Default size limit of the spill file */
+#define ASEE_SPILL_MAX (256UL << 20)
+/* Default refresh period of the status page */
+#define ASEE_STATUS_US 1000
+/* Keyed records: shards of a channel, members of its consumer group */
+#define ASEE_MAX_SHARDS 16
+#define ASEE_MAX_MEMBERS 16
+#define ASEE_SHARDS 4
+#define ASEE_SHARD_MAX (1024 * 1024)
+/* Sink: default batch and fsync period, longest wait for a batch to fill */
+#define ASEE_SINK_BATCH (256 * 1024)
+#define ASEE_SINK_MAX_BATCH (16 << 20)
+#define ASEE_SINK_FSYNC_MS 1000
+#define ASEE_SINK_DELAY_MS 100
+/* Bytes an IRQ-side producer can stage on a CPU until the bottom half runs */
+#define ASEE_IRQ_STAGE 2048
+/* Default number of gifted buffers a channel queues */
+#define ASEE_GIFT_MAX 256
+/* Order of the huge pages of asee_huge_pages, 0 if there are none */
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+#define ASEE_HUGE_ORDER HPAGE_PMD_ORDER
+#else
+#define ASEE_HUGE_ORDER 0
+#endif
 
 
 /* Global variables are declared as static, so are global within the file. */
 
 static int major; /* major number assigned to our device driver */
-static char *circular_buffer;
-static int write_index = 0;
-static int read_index = 0;
-static int asee_buf_size = BUF_LEN;
-static int asee_buf_count = 0;
-/* Queue of processes who want our file */
-static DECLARE_WAIT_QUEUE_HEAD(read_waitq);
-static DECLARE_WAIT_QUEUE_HEAD(write_waitq);
-
-//static char *msg_ptr;
-//static int count = 0;
-//static int byte_written = 0;
+
+static int nr_channels = 1;
+module_param(nr_channels, int, 0444);
+MODULE_PARM_DESC(nr_channels, "Number of channels, /dev/asee_mod, "
+                 "/dev/asee_mod1, ... (default 1)");
+
+static int numa_node = NUMA_NO_NODE;
+module_param(numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "NUMA node of the channels and their rings "
+                 "(default -1, the node of the CPU loading the module)");
+
+static unsigned int idle_secs = 10;
+module_param(idle_secs, uint, 0644);
+MODULE_PARM_DESC(idle_secs, "Seconds without reads or writes after which "
+                 "an empty ring may be freed under memory pressure "
+                 "(default 10)");
+
+static char *sync_backend[ASEE_MAX_CHANNELS];
+static int nr_sync_backend;
+module_param_array_named(sync, sync_backend, charp, &nr_sync_backend, 0444);
+MODULE_PARM_DESC(sync, "Synchronization of the rings, per channel: lockfree, "
+                 "spinlock or mutex (default lockfree; the last one given "
+                 "goes for the channels after it)");
+
+/* How often a channel in auto NUMA mode looks at where it is read from */
+#define ASEE_NUMA_INTERVAL HZ
+/* Bytes that must be read in an interval before the ring moves */
+#define ASEE_NUMA_MIN_BYTES (64 * 1024)
+
+/* What a writer does when the channel is full */
+enum asee_policy {
+    ASEE_POLICY_BLOCK,            /* sleep until there is space (TP3) */
+    ASEE_POLICY_OVERWRITE_OLDEST, /* discard the oldest bytes (TP1) */
+    ASEE_POLICY_DROP_NEWEST,      /* discard what does not fit */
+    ASEE_POLICY_SPILL,            /* go on in a shmem file, spill_file */
+};
+
+static const char * const asee_policy_names[] = {
+    [ASEE_POLICY_BLOCK] = "block",
+    [ASEE_POLICY_OVERWRITE_OLDEST] = "overwrite-oldest",
+    [ASEE_POLICY_DROP_NEWEST] = "drop-newest",
+    [ASEE_POLICY_SPILL] = "spill",
+};
+
+/* Who shares a rate limit (asee_rate_scope), and what happens beyond it
+ * (asee_rate_action)
+ */
+enum asee_rate_scope {
+    ASEE_RATE_PROCESS,
+    ASEE_RATE_CGROUP,
+};
+
+static const char * const asee_rate_scope_names[] = {
+    [ASEE_RATE_PROCESS] = "process",
+    [ASEE_RATE_CGROUP] = "cgroup",
+};
+
+enum asee_rate_action {
+    ASEE_RATE_BLOCK,
+    ASEE_RATE_EAGAIN,
+    ASEE_RATE_DROP,
+};
+
+static const char * const asee_rate_action_names[] = {
+    [ASEE_RATE_BLOCK] = "block",
+    [ASEE_RATE_EAGAIN] = "eagain",
+    [ASEE_RATE_DROP] = "drop",
+};
+
+/* Scheduling classes of the waiters, for their wait times */
+enum asee_wclass {
+    ASEE_WCLASS_DEADLINE,
+    ASEE_WCLASS_RT,
+    ASEE_WCLASS_NORMAL,
+    ASEE_WCLASS_BATCH,
+    ASEE_WCLASS_IDLE,
+    ASEE_NR_WCLASS,
+};
+
+static const char * const asee_wclass_names[] = {
+    [ASEE_WCLASS_DEADLINE] = "deadline",
+    [ASEE_WCLASS_RT] = "rt",
+    [ASEE_WCLASS_NORMAL] = "normal",
+    [ASEE_WCLASS_BATCH] = "batch",
+    [ASEE_WCLASS_IDLE] = "idle",
+};
+
+/* How the transfers of a ring exclude each other, see asee_sync_ops */
+enum asee_sync {
+    ASEE_SYNC_LOCKFREE,
+    ASEE_SYNC_SPINLOCK,
+    ASEE_SYNC_MUTEX,
+};
+
+static const char * const asee_sync_names[] = {
+    [ASEE_SYNC_LOCKFREE] = "lockfree",
+    [ASEE_SYNC_SPINLOCK] = "spinlock",
+    [ASEE_SYNC_MUTEX] = "mutex",
+};
+
+/*
+ * Pages of a ring, mapped twice back to back in data: the byte at
+ * data + size + i is the byte at data + i, so any range of up to size bytes
+ * starting in the first copy is contiguous, wrap or not. The pages are
+ * mapped the same way by mmap(). A ring is only freed once the channel and
+ * the mappings of it are done with it.
+ */
+struct asee_ring {
+    struct kref ref;
+    char *data;
+    unsigned int size;      /* nr_pages * PAGE_SIZE */
+    unsigned int nr_pages;
+    unsigned int order;     /* of the allocations, ASEE_HUGE_ORDER or 0 */
+    struct page **pages;    /* [2 * nr_pages], the second half repeats */
+};
+
+/*
+ * Elastic channels (asee_elastic) keep their data in a list of chunks from
+ * asee_chunk_cache instead of a ring: a chunk is added when the last one is
+ * full, and freed once read, so the memory follows the fill level up to
+ * asee_buf_size, and nothing is moved when the channel grows.
+ */
+struct asee_chunk {
+    struct list_head list;
+    unsigned int head; /* first unread byte of data */
+    unsigned int tail; /* end of the written bytes */
+    char data[];
+};
+
+#define ASEE_CHUNK_DATA (ASEE_CHUNK_SIZE - sizeof(struct asee_chunk))
+
+/* A list of chunks, used as a FIFO of bytes */
+struct asee_chunkq {
+    struct list_head chunks;
+    unsigned long len; /* bytes queued */
+    unsigned int nr_chunks;
+    unsigned int chunks_peak;
+};
+
+/*
+ * Lanes of a channel. Lane 0 is the buffer of the channel (ring, elastic
+ * or spill), lanes 1 to ASEE_NR_LANES - 1 are chunk queues of increasing
+ * priority, at most max bytes each, for the small messages that must not
+ * wait behind bulk data. A file writes to one lane (ASEE_IOC_SET_LANE, or
+ * ASEE_IOC_WRITE_LANE for one write). Readers take from the highest lane
+ * that has data, or in weighted-fair mode (asee_lane_mode), from each lane
+ * in turn, up to weight * ASEE_LANE_QUANTUM bytes per round (deficit round
+ * robin), so that no lane starves.
+ */
+#define ASEE_LANE_MAX (64 * 1024)
+#define ASEE_LANE_QUANTUM 1024
+
+struct asee_lane {
+    struct mutex lock;
+    struct asee_chunkq q;
+    unsigned long max;
+    unsigned int weight;
+    long deficit;          /* under lane_lock */
+    atomic_long_t dropped;
+};
+
+static struct kmem_cache *asee_chunk_cache;
+
+/*
+ * Keyed records (ASEE_IOC_WRITE_KEYED) go to shard hash(key) % nr_shards,
+ * a chunk queue of records, each after its length as a u32, at most
+ * shard_max bytes. The files that join the consumer group of the channel
+ * (ASEE_IOC_JOIN_GROUP) are its members: each shard is read by one of
+ * them, owner, so the records of a key are read in order. The shards are
+ * dealt to the members again whenever one joins or leaves.
+ */
+struct asee_shard {
+    struct mutex lock;
+    struct asee_chunkq q;
+    unsigned long records;
+    int owner;              /* member slot, -1 while the group is empty */
+};
+
+/*
+ * Interrupt side of a channel, see asee_irq_produce(): what the handlers
+ * of a CPU queued since the bottom half last ran. first_ns is when the
+ * oldest of these bytes came.
+ */
+struct asee_irq_stage {
+    raw_spinlock_t lock;
+    unsigned int len;
+    u64 first_ns;
+    char buf[ASEE_IRQ_STAGE];
+};
+
+/*
+ * Token buckets of a writer (a process, or a cgroup), for the byte and the
+ * record limits of the channel. Each is kept as the time at which it will
+ * be full again (tat, as in GCRA), which refills it lazily, without
+ * rounding: a write costs len / rate seconds of it, and is over the limit
+ * while the bucket is full again more than a second (the burst) from now.
+ */
+struct asee_bucket {
+    struct hlist_node node;
+    u64 id;                  /* tgid or cgroup id */
+    char comm[TASK_COMM_LEN];
+    u64 tat_bytes;
+    u64 tat_records;
+    u64 last_ns;             /* last write */
+    unsigned long bytes;
+    unsigned long records;
+    unsigned long throttled; /* writes that were over the limit */
+    unsigned long dropped;   /* bytes dropped by the drop action */
+    u64 wait_ns;             /* time spent blocked by the block action */
+};
+
+/* Buckets idle for that long are freed when new ones are made */
+#define ASEE_BUCKET_IDLE_NS (10 * NSEC_PER_SEC)
+#define ASEE_BUCKETS_KEPT 256
+
+/* Latency samples: their number, sum and maximum */
+struct asee_lat {
+    atomic_long_t count;
+    atomic64_t sum_ns;
+    u64 max_ns;
+};
+
+/*
+ * State of a channel, /dev/asee_mod for the first one.
+ *
+ * By default the ring is lock-free: the positions are free-running
+ * counters, taken modulo ring_size to index circular_buffer. Several
+ * producers and several consumers may work on it at the same time. Each
+ * side first reserves a range by moving its head with cmpxchg(), copies,
+ * then publishes the range by moving its tail, in reservation order. Bytes
+ * between cons_tail and prod_tail are stored; asee_buf_count is their
+ * number. The same scheme as DPDK's rte_ring.
+ *
+ * A reservation, its copy and its commit run with preemption disabled and
+ * only ever copy kernel memory (user bytes go through a bounce buffer), so
+ * a task waiting for its turn to commit only ever waits for a running CPU.
+ *
+ * resize_sem only excludes the rare resize of the buffer: its read side is
+ * a per-CPU counter, so producers and consumers do not share any lock.
+ *
+ * The spinlock and mutex backends (asee_sync) run the same protocol under
+ * one lock of the channel instead, taken by readers and writers alike.
+ */
+struct asee_channel {
+    char name[16];
+    int minor;
+    struct kobject *kobj;
+
+    struct asee_ring *ring;      /* NULL until the first write */
+    struct mutex replace_lock;   /* serializes replacements of the ring */
+    struct work_struct release_work; /* frees an idle ring, see the shrinker */
+
+    /* Elastic mode: the data is in chunks, not in ring. The positions
+     * keep counting the bytes, moved under elastic_lock.
+     */
+    bool elastic;
+    struct mutex elastic_lock;
+    struct asee_chunkq chunkq;
+    atomic_long_t chunk_grows;  /* of all the chunk queues of the channel */
+    atomic_long_t chunk_shrinks;
+
+    /* Shards and consumer group, see asee_shard. group_sem is taken for
+     * writing to change nr_shards or the members, and for reading around
+     * the transfers. members is the bitmap of the slots in use.
+     */
+    struct rw_semaphore group_sem;
+    struct asee_shard shards[ASEE_MAX_SHARDS];
+    unsigned int nr_shards;
+    unsigned long shard_max;
+    unsigned long members;
+    atomic_long_t rebalances;
+
+    /* Priority lanes, see asee_lane. lanes[0] only has the weight and
+     * deficit of lane 0. lanes_len is the number of bytes in the others.
+     */
+    struct asee_lane lanes[ASEE_NR_LANES];
+    atomic_long_t lanes_len;
+    bool lanes_fair;
+    unsigned int lane_rr;  /* lane being served in fair mode */
+    spinlock_t lane_lock;
+
+    /* Spill policy: the overflow of the ring, in order, in spill_file
+     * between spill_rpos and spill_wpos, at most spill_max bytes
+     * (asee_spill_max). See asee_spill_write().
+     */
+    struct mutex spill_lock;
+    struct file *spill_file;
+    char *spill_page;
+    loff_t spill_rpos;
+    loff_t spill_wpos;
+    loff_t spill_freed; /* pages before this were given back */
+    unsigned long spill_len;
+    unsigned long spill_max;
+    atomic_long_t spilled;
+    atomic_long_t refilled;
+    bool huge;                   /* asee_huge_pages */
+    spinlock_t ring_lock;        /* ring, for device_mmap() */
+    atomic_t ring_gen;           /* bumped when the ring is replaced */
+    char *circular_buffer;       /* ring->data */
+    unsigned int ring_size;      /* ring->size */
+    unsigned int asee_buf_size;  /* capacity, at most ring_size */
+    enum asee_policy policy;
+    struct percpu_rw_semaphore resize_sem;
+
+    /* Rate limits of the writers (asee_rate_*), 0 for none: their token
+     * buckets, by writer, under rate_lock.
+     */
+    unsigned int rate_bytes;   /* bytes/s */
+    unsigned int rate_records; /* write()s/s */
+    enum asee_rate_scope rate_scope;
+    enum asee_rate_action rate_action;
+    spinlock_t rate_lock;
+    DECLARE_HASHTABLE(buckets, 6);
+    unsigned int nr_buckets;
+
+    /* Backend of the ring transfers (asee_sync), changed under the write
+     * side of resize_sem. sync_contended counts the lock acquisitions
+     * that had to wait.
+     */
+    enum asee_sync sync;
+    spinlock_t sync_spin;
+    struct mutex sync_mutex;
+    atomic_long_t sync_contended;
+
+    /* NUMA placement of circular_buffer (asee_numa_node): node is where
+     * it was asked to be, NUMA_NO_NODE for anywhere. In auto mode, the
+     * bytes read from each node are counted, and numa_work moves the ring
+     * to the node that reads most of them. The channel itself, with its
+     * positions and wait queues, stays on the node given at load time.
+     */
+    int node;
+    bool node_auto;
+    atomic_long_t *node_bytes; /* [nr_node_ids] */
+    struct delayed_work numa_work;
+
+    unsigned long prod_head ____cacheline_aligned_in_smp;
+    unsigned long prod_tail;
+
+    unsigned long cons_head ____cacheline_aligned_in_smp;
+    unsigned long cons_tail;
+
+    /* Queues of processes who want to read or write. Waiters are
+     * exclusive and queued by priority, in arrival order within a
+     * priority, so a wake-up only hands the data (or the space) to as
+     * many tasks as can actually use it, the most urgent ones first.
+     */
+    wait_queue_head_t read_waitq ____cacheline_aligned_in_smp;
+    wait_queue_head_t write_waitq;
+
+    /* Running averages of the transfer sizes, used to size wake-ups */
+    unsigned int read_avg;
+    unsigned int write_avg;
+
+    /* Busy-poll budget (asee_busy_poll, in microseconds): a reader that
+     * finds the ring empty, or a writer that finds it full, spins for up
+     * to this long before going to sleep. The budget is cut down to the
+     * observed time between writes (resp. reads), and not spent at all
+     * when the other side is known to be slower than the budget.
+     */
+    unsigned int busy_poll_us;
+    u64 last_read_ns;
+    u64 last_write_ns;
+    u64 read_gap_ns;  /* average time between two reads */
+    u64 write_gap_ns; /* average time between two writes */
+
+    /* asee_strip_newline: a write() ending in '\n' is stored without it,
+     * for the messages written with echo. Off by default, the bytes are
+     * stored as they are written.
+     */
+    bool strip_nl;
+
+    /* Default read thresholds of the files opened on the channel, like
+     * termios' VMIN/VTIME: a read returns once read_min bytes are there,
+     * or read_timeout_us after the first byte came, whichever is first.
+     */
+    unsigned int read_min;
+    unsigned int read_timeout_us;
+
+    /* Counters reported in asee_stats */
+    atomic_long_t read_wakeups;
+    atomic_long_t write_wakeups;
+    atomic_long_t bytes_read;
+    atomic_long_t bytes_written;
+    atomic_long_t reads;       /* read() calls that returned data */
+    atomic64_t spin_ns;
+    atomic64_t sleep_ns;
+    atomic_long_t spin_hits;
+    atomic_long_t spin_misses;
+    atomic_long_t dropped;     /* bytes lost to the overflow policy */
+    atomic_long_t drop_events; /* writes that lost bytes */
+
+    /* Queue of the pages handed over whole (see asee_gift), at most
+     * gift_max (asee_gift_max) buffers.
+     */
+    spinlock_t gift_lock;
+    struct list_head gifts;
+    unsigned int gift_count;
+    unsigned int gift_max;
+    atomic_long_t gift_pages;
+    atomic_long_t gift_bytes;
+
+    /* Status page (ASEE_MMAP_STATUS), refreshed by status_timer every
+     * status_us while status_maps mappings of it exist.
+     */
+    struct asee_status *status;
+    struct hrtimer status_timer;
+    atomic_t status_maps;
+    unsigned int status_us;
+
+    /* Sink (asee_sink): sink_task drains lane 0 into sink_file, by batches
+     * of up to sink_batch bytes copied to sink_buf, with an fsync every
+     * sink_fsync_ms. Attached and detached under sink_lock; sink_batch
+     * only changes while detached. sink_rate is in bytes/s, over the last
+     * second.
+     */
+    struct mutex sink_lock;
+    struct task_struct *sink_task;
+    struct file *sink_file;
+    char *sink_path;
+    char *sink_buf;
+    unsigned int sink_batch;
+    unsigned int sink_fsync_ms;
+    atomic_long_t sink_bytes;
+    atomic_long_t sink_batches;
+    atomic_long_t sink_fsyncs;
+    atomic_long_t sink_errors;
+    int sink_error;              /* the last one */
+    unsigned long sink_rate;
+
+    /* Tasks sleeping in asee_wait(), for /proc/asee_mod, and how long
+     * they slept, by scheduling class ([0] readers, [1] writers)
+     */
+    atomic_t read_waiters;
+    atomic_t write_waiters;
+    struct asee_lat wait_lat[2][ASEE_NR_WCLASS];
+    /* Bumped by an abort (asee_irq), which fails all the waits then */
+    atomic_t abort_gen;
+
+    /* IRQ-side producers (asee_irq_produce()) stage their bytes per CPU,
+     * irq_bh moves them to the channel through irq_bounce and wakes the
+     * readers. irq_sim is the simulated interrupt of asee_irq, queuing
+     * irq_sim_nr records. irq_mark_ns is when the oldest byte before
+     * position irq_mark_pos was raised, until a reader gets past it.
+     */
+    struct asee_irq_stage __percpu *irq_stage;
+    struct work_struct irq_bh;
+    char *irq_bounce;
+    struct irq_work irq_sim;
+    atomic_t irq_sim_nr;
+    atomic_long_t irq_seq;
+    atomic_long_t irq_bytes;
+    atomic_long_t irq_dropped;
+    unsigned long irq_mark_pos;
+    u64 irq_mark_ns;
+    struct asee_lat irq_bh_lat;   /* interrupt to publication */
+    struct asee_lat irq_read_lat; /* interrupt to read() */
+
+    /* Throughput shown in /proc/asee_mod, computed again from these
+     * snapshots at most once per second by whoever reads the file.
+     */
+    u64 rate_ns;
+    long rate_written;
+    long rate_read;
+    unsigned long write_rate; /* bytes per second */
+    unsigned long read_rate;
+};
+
+static struct asee_channel *asee_chans[ASEE_MAX_CHANNELS];
+
+/*
+ * Synchronization backends: what a reservation, its copy and its commit
+ * run under. lockfree only disables preemption, as the protocol needs;
+ * spinlock and mutex serialize all the transfers of the channel, so a
+ * commit never waits for another CPU. In all three, the copies under a
+ * reservation are from or to kernel memory, never user space.
+ *
+ * lockfree and spinlock disable bottom halves rather than just
+ * preemption: the in-kernel API (asee_reserve()) may be used from a
+ * softirq, which must not spin on a range reserved by the task it
+ * interrupted.
+ */
+struct asee_sync_ops {
+    void (*lock)(struct asee_channel *ch);
+    void (*unlock)(struct asee_channel *ch);
+};
+
+static void asee_lockfree_lock(struct asee_channel *ch)
+{
+    local_bh_disable();
+}
+
+static void asee_lockfree_unlock(struct asee_channel *ch)
+{
+    local_bh_enable();
+}
+
+static void asee_spinlock_lock(struct asee_channel *ch)
+{
+    if (spin_trylock_bh(&ch->sync_spin))
+        return;
+    atomic_long_inc(&ch->sync_contended);
+    spin_lock_bh(&ch->sync_spin);
+}
+
+static void asee_spinlock_unlock(struct asee_channel *ch)
+{
+    spin_unlock_bh(&ch->sync_spin);
+}
+
+static void asee_mutex_lock(struct asee_channel *ch)
+{
+    if (mutex_trylock(&ch->sync_mutex))
+        return;
+    atomic_long_inc(&ch->sync_contended);
+    mutex_lock(&ch->sync_mutex);
+}
+
+static void asee_mutex_unlock(struct asee_channel *ch)
+{
+    mutex_unlock(&ch->sync_mutex);
+}
+
+static const struct asee_sync_ops asee_sync_backends[] = {
+    [ASEE_SYNC_LOCKFREE] = { asee_lockfree_lock, asee_lockfree_unlock },
+    [ASEE_SYNC_SPINLOCK] = { asee_spinlock_lock, asee_spinlock_unlock },
+    [ASEE_SYNC_MUTEX] = { asee_mutex_lock, asee_mutex_unlock },
+};
+
+/* Per open file */
+struct asee_file {
+    struct asee_channel *ch;
+    long lost_seen; /* ch->dropped when last reported to this file */
+    unsigned int read_min;        /* see asee_channel.read_min */
+    unsigned int read_timeout_us;
+    unsigned int lane;            /* lane written to, ASEE_IOC_SET_LANE */
+    int member;                   /* slot in the consumer group, or -1 */
+    unsigned int shard_rr;        /* next shard to look at */
+
+    /* Write combining (ASEE_IOC_SET_WRITE_COMBINE): writes smaller than
+     * wc_size are staged in wc_buf, and published to the ring in one go
+     * when wc_size bytes are staged, wc_flush_us after the first staged
+     * byte, or on flush()/fsync(). wc_lock keeps the writes of the file
+     * in order, staged or not.
+     */
+    struct mutex wc_lock;
+    char *wc_buf;
+    unsigned int wc_size;
+    unsigned int wc_len;
+    unsigned int wc_flush_us;
+    struct hrtimer wc_timer;
+    struct work_struct wc_work;
+};
+
 static struct kobject *mymodule;
-//char *buff_ptr = circular_buffer;
 
 enum {
     CDEV_NOT_USED = 0,
@@ -63,230 +673,4863 @@ enum {
 /* Is device open? Used to prevent multiple access to device */
 static atomic_t already_open = ATOMIC_INIT(CDEV_NOT_USED);
 
-//static char message[BUF_LEN]; /*the circular buffer*/
-
 static struct class *cls;
 
 static struct file_operations chardev_fops = {
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
+    .poll = device_poll,
+    .unlocked_ioctl = device_ioctl,
     .open = device_open,
+    .flush = device_flush,
+    .fsync = device_fsync,
+    .mmap = device_mmap,
+    .get_unmapped_area = device_get_unmapped_area,
+    .splice_write = device_splice_write,
+    .splice_read = device_splice_read,
     .release = device_release,
 };
 
-// fonction pour manipuler la taille du buffer
-static ssize_t asee_buf_size_show(struct kobject *kobj,
-                               struct kobj_attribute *attr, char *buf)
+/* The sysfs files of the first channel are in /sys/kernel/mymodule, those
+ * of the other channels in /sys/kernel/mymodule/<name>.
+ */
+static struct asee_channel *asee_chan_of(struct kobject *kobj)
 {
-    return sprintf(buf, "%d\n", asee_buf_size);
+    int i;
+
+    for (i = 0; i < nr_channels; i++)
+        if (asee_chans[i]->kobj == kobj)
+            return asee_chans[i];
+    return NULL;
 }
 
-static ssize_t asee_buf_size_store(struct kobject *kobj,
-                                struct kobj_attribute *attr, char *buf,
-                                size_t count)
+static unsigned int asee_count(struct asee_channel *ch)
 {
-    int new_buffer_size = 0;
-    sscanf(buf, "%du", &new_buffer_size);
+    return smp_load_acquire(&ch->prod_tail) - READ_ONCE(ch->cons_tail);
+}
 
-    if(new_buffer_size == asee_buf_size){
-        return count;
-    }else if(new_buffer_size < asee_buf_size){
-          if(new_buffer_size < asee_buf_count){
-              pr_err("there are more characters in the actual buffer than the require size");
-              return -1;
-          } else {
-                  asee_buf_size = new_buffer_size;
-          }
-    }else{
-            asee_buf_size = new_buffer_size;
-            char  *new_circular_buffer = (char*)kmalloc(new_buffer_size * sizeof(char),GFP_KERNEL);
-            for(int i = 0 ; i < asee_buf_count; i++){
-                new_circular_buffer[i] = circular_buffer[i];
-            };
-            kfree(circular_buffer);
-            circular_buffer = new_circular_buffer;
+/* Fill ring with pages of the given order, enough for capacity bytes */
+static int asee_ring_fill(struct asee_ring *ring, unsigned int capacity,
+                          int node, unsigned int order)
+{
+    gfp_t gfp = GFP_KERNEL_ACCOUNT | __GFP_ZERO;
+    unsigned int i, j, step = 1 << order;
+    struct page *page;
+
+    /* Huge pages are only worth it if they come easily */
+    if (order)
+        gfp |= __GFP_NOWARN | __GFP_NORETRY;
 
+    ring->order = order;
+    ring->nr_pages = DIV_ROUND_UP(capacity, PAGE_SIZE << order) << order;
+    ring->size = ring->nr_pages * PAGE_SIZE;
+    ring->pages = kvcalloc(2 * ring->nr_pages, sizeof(*ring->pages),
+                           GFP_KERNEL_ACCOUNT);
+    if (!ring->pages)
+        return -ENOMEM;
+
+    for (i = 0; i < ring->nr_pages; i += step) {
+        page = alloc_pages_node(node, gfp, order);
+        if (!page)
+            return -ENOMEM;
+        for (j = 0; j < step; j++) {
+            ring->pages[i + j] = page + j;
+            ring->pages[ring->nr_pages + i + j] = page + j;
+        }
     }
-    return count;
+    return 0;
 }
 
-static struct kobj_attribute asee_buf_size_attribute =
-  __ATTR(asee_buf_size, 0660, asee_buf_size_show, (void *)asee_buf_size_store);
+static void asee_ring_free_pages(struct asee_ring *ring)
+{
+    unsigned int i;
 
-//fonctions pour lire le nombre de caractereqs presents dans le buffer
-static ssize_t asee_buf_count_show(struct kobject *kobj,
-                               struct kobj_attribute *attr, char *buf)
+    for (i = 0; ring->pages && i < ring->nr_pages && ring->pages[i];
+         i += 1 << ring->order)
+        __free_pages(ring->pages[i], ring->order);
+    kvfree(ring->pages);
+    ring->pages = NULL;
+}
+
+/* A ring of at least capacity bytes, of huge pages if asked for and if
+ * there are enough of them, of base pages otherwise. It is charged to the
+ * memory cgroup of the caller, usually the first writer.
+ */
+static struct asee_ring *asee_ring_alloc(unsigned int capacity, int node,
+                                         bool huge)
 {
-    return sprintf(buf, "%d\n", asee_buf_count);
+    struct asee_ring *ring;
+
+    ring = kzalloc_node(sizeof(*ring), GFP_KERNEL_ACCOUNT, node);
+    if (!ring)
+        return NULL;
+    kref_init(&ring->ref);
+
+    if (!huge || !ASEE_HUGE_ORDER ||
+        asee_ring_fill(ring, capacity, node, ASEE_HUGE_ORDER)) {
+        asee_ring_free_pages(ring);
+        if (asee_ring_fill(ring, capacity, node, 0))
+            goto err;
+    }
+
+    ring->data = vmap(ring->pages, 2 * ring->nr_pages, VM_MAP, PAGE_KERNEL);
+    if (!ring->data)
+        goto err;
+    return ring;
+
+err:
+    asee_ring_free_pages(ring);
+    kfree(ring);
+    return NULL;
 }
 
-static ssize_t asee_buf_count_store(struct kobject *kobj,
-                                struct kobj_attribute *attr, char *buf,
-                                size_t count)
+static void asee_ring_release(struct kref *ref)
 {
-      pr_err("this function is not yet implemented");
-      return -1;
+    struct asee_ring *ring = container_of(ref, struct asee_ring, ref);
+
+    vunmap(ring->data);
+    asee_ring_free_pages(ring);
+    kfree(ring);
 }
 
-static struct kobj_attribute asee_buf_count_attribute =
-  __ATTR(asee_buf_count, 0660, asee_buf_count_show, (void *)asee_buf_count_store);
+static void asee_ring_put(struct asee_ring *ring)
+{
+    kref_put(&ring->ref, asee_ring_release);
+}
 
+static void asee_wake_readers(struct asee_channel *ch);
+static void asee_wake_writers(struct asee_channel *ch);
 
-static int __init chardev_init(void)
+/*
+ * Give the channel a new ring of capacity bytes, on the given node, of
+ * huge pages or not, and move the stored bytes to it. The positions start
+ * again from 0. Called with replace_lock held.
+ */
+static int asee_replace_ring(struct asee_channel *ch, unsigned int capacity,
+                             int node, bool huge)
 {
-    //on initialise le buffer
-    circular_buffer = (char*)kmalloc(BUF_LEN * sizeof(char),GFP_KERNEL);
-    major = register_chrdev(0, DEVICE_NAME, &chardev_fops);
+    struct asee_ring *ring, *old;
+    unsigned int stored;
 
-    if (major < 0) {
-        pr_alert("Registering char device failed with %d\n", major);
-        return major;
+    ring = asee_ring_alloc(capacity, node, huge);
+    if (!ring)
+        return -ENOMEM;
+
+    /* Wait for the transfers in progress to finish, and keep new ones out */
+    percpu_down_write(&ch->resize_sem);
+    stored = ch->prod_tail - ch->cons_tail;
+    if (capacity < stored) {
+        percpu_up_write(&ch->resize_sem);
+        asee_ring_put(ring);
+        return -EBUSY;
     }
 
-    pr_info("I was assigned major number %d.\n", major);
+    /* The positions are taken modulo the size, so the content has to be
+     * laid out again from the start of the new ring. It is contiguous in
+     * the old one.
+     */
+    if (stored)
+        memcpy(ring->data,
+               ch->circular_buffer + ch->cons_tail % ch->ring_size, stored);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
-    cls = class_create(DEVICE_NAME);
-#else
-    cls = class_create(THIS_MODULE, DEVICE_NAME);
-#endif
-    device_create(cls, NULL, MKDEV(major, 0), NULL, DEVICE_NAME);//vider le buffer
+    old = ch->ring;
+    spin_lock(&ch->ring_lock);
+    ch->ring = ring;
+    spin_unlock(&ch->ring_lock);
+    ch->circular_buffer = ring->data;
+    ch->ring_size = ring->size;
+    ch->asee_buf_size = capacity;
+    ch->cons_head = ch->cons_tail = 0;
+    ch->prod_head = ch->prod_tail = stored;
+    WRITE_ONCE(ch->irq_mark_ns, 0);
+    WRITE_ONCE(ch->node, node);
+    atomic_inc(&ch->ring_gen);
+    percpu_up_write(&ch->resize_sem);
 
+    if (old)
+        asee_ring_put(old);
+    asee_wake_writers(ch);
+    return 0;
+}
+
+/* Give the channel its ring, on first write */
+static int asee_ring_populate(struct asee_channel *ch)
+{
     int error = 0;
 
-    pr_info("mymodule: initialised\n");
+    mutex_lock(&ch->replace_lock);
+    if (!ch->ring && !ch->elastic)
+        error = asee_replace_ring(ch, ch->asee_buf_size, ch->node, ch->huge);
+    mutex_unlock(&ch->replace_lock);
+    return error;
+}
 
-    mymodule = kobject_create_and_add("mymodule", kernel_kobj);
-    if (!mymodule)
-        return -ENOMEM;
+/* Take the ring away from an empty channel, under the write side of
+ * resize_sem. Returns it, for the caller to put.
+ */
+static struct asee_ring *asee_ring_detach(struct asee_channel *ch)
+{
+    struct asee_ring *ring = ch->ring;
 
-    error = sysfs_create_file(mymodule, &asee_buf_size_attribute.attr);
-    if (error) {
-        pr_info("failed to create the asee_buf_size file "
-                "in /sys/kernel/mymodule\n");
-    }
-    error = sysfs_create_file(mymodule, &asee_buf_count_attribute.attr);
-    if (error) {
-        pr_info("failed to create the asee_buf_count file "
-                "in /sys/kernel/mymodule\n");
-    }
-    return SUCCESS;
+    spin_lock(&ch->ring_lock);
+    ch->ring = NULL;
+    spin_unlock(&ch->ring_lock);
+    ch->circular_buffer = NULL;
+    ch->ring_size = 0;
+    ch->cons_head = ch->cons_tail = 0;
+    ch->prod_head = ch->prod_tail = 0;
+    atomic_inc(&ch->ring_gen);
+    return ring;
 }
 
-static void __exit chardev_exit(void)
+// fonction pour manipuler la taille du buffer
+static ssize_t asee_buf_size_show(struct kobject *kobj,
+                               struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", asee_chan_of(kobj)->asee_buf_size);
+}
+
+static ssize_t asee_buf_size_store(struct kobject *kobj,
+                                struct kobj_attribute *attr, char *buf,
+                                size_t count)
 {
-    //on libere le tampon circulaire
-    if(circular_buffer){
-           kfree(circular_buffer);
-           circular_buffer = NULL;
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned int new_buffer_size;
+    int error = 0;
+
+    if (kstrtouint(buf, 0, &new_buffer_size) || !new_buffer_size ||
+        new_buffer_size > INT_MAX / 2)
+        return -EINVAL;
+
+    mutex_lock(&ch->replace_lock);
+    percpu_down_write(&ch->resize_sem);
+    if (new_buffer_size < ch->prod_tail - ch->cons_tail) {
+        error = -EBUSY;
+    } else if (!ch->ring || (new_buffer_size <= ch->ring_size &&
+               new_buffer_size > ch->ring_size - (PAGE_SIZE << ch->ring->order))) {
+        /* Without a ring yet, or within the pages we have, only the
+         * capacity changes
+         */
+        ch->asee_buf_size = new_buffer_size;
+        percpu_up_write(&ch->resize_sem);
+        asee_wake_writers(ch);
+        mutex_unlock(&ch->replace_lock);
+        return count;
     }
-    device_destroy(cls, MKDEV(major, 0));
-    class_destroy(cls);
+    percpu_up_write(&ch->resize_sem);
 
-    pr_info("mymodule: Exit success\n");
-    kobject_put(mymodule);
-    /* Unregister the device */
-    unregister_chrdev(major, DEVICE_NAME);
+    if (!error)
+        error = asee_replace_ring(ch, new_buffer_size, READ_ONCE(ch->node),
+                                  ch->huge);
+    mutex_unlock(&ch->replace_lock);
 
+    /* -EBUSY: the ring holds more than the new size */
+    return error ? error : count;
 }
 
-/* Methods */
-
-/* 
-*cette fonction verifie si il y'a des signaux presents dans la 
-* dans la liste d'attente des signaux du process en cours
-*/
-static int controlCcheck(){
-           int i = 0,is_sig = 0; 
-
-            for (i = 0; i < _NSIG_WORDS && !is_sig; i++) 
-                is_sig = current->pending.signal.sig[i] & ~current->blocked.sig[i]; 
-            return is_sig;
-} 
-/* Called when a process tries to open the device file, like
- * "sudo cat /dev/chardev"
- */
-static int device_open(struct inode *inode, struct file *file)
-{    
- 
-    //static int counter = 0;
+static struct kobj_attribute asee_buf_size_attribute =
+  __ATTR(asee_buf_size, 0660, asee_buf_size_show, (void *)asee_buf_size_store);
 
-    //if (atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
-        //return -EBUSY;
+/* Free the token buckets, idle ones only unless all is set */
+static void asee_rate_flush(struct asee_channel *ch, bool all)
+{
+    struct asee_bucket *b;
+    struct hlist_node *tmp;
+    u64 now = ktime_get_ns();
+    int bkt;
 
-    //sprintf(msg, "I already told you %d times Hello world!\n", counter++);
-    try_module_get(THIS_MODULE);
+    lockdep_assert_held(&ch->rate_lock);
+    hash_for_each_safe(ch->buckets, bkt, tmp, b, node) {
+        if (!all && (now - b->last_ns < ASEE_BUCKET_IDLE_NS ||
+                     b->tat_bytes > now || b->tat_records > now))
+            continue;
+        hash_del(&b->node);
+        kfree(b);
+        ch->nr_buckets--;
+    }
+}
 
-    return SUCCESS;
+/* Rate limit of each writer in bytes/s, 0 for none */
+static ssize_t asee_rate_bytes_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(asee_chan_of(kobj)->rate_bytes));
 }
 
-/* Called when a process closes the device file. */
-static int device_release(struct inode *inode, struct file *file)
+static ssize_t asee_rate_bytes_store(struct kobject *kobj,
+                                     struct kobj_attribute *attr,
+                                     const char *buf, size_t count)
 {
-    /* We're now ready for our next caller */
-    atomic_set(&already_open, CDEV_NOT_USED);
+    unsigned int rate;
 
-    /* Decrement the usage count, or else once you opened the file, you will
-     * never get rid of the module.
-     */
-    module_put(THIS_MODULE);
-    return SUCCESS;
+    if (kstrtouint(buf, 0, &rate))
+        return -EINVAL;
+    WRITE_ONCE(asee_chan_of(kobj)->rate_bytes, rate);
+    return count;
 }
 
-/* cette fonction est appelée losqu'on effectue la commande echo au niveau du terminal
- */
+static struct kobj_attribute asee_rate_bytes_attribute =
+  __ATTR(asee_rate_bytes, 0660, asee_rate_bytes_show, asee_rate_bytes_store);
 
- static ssize_t device_read(struct file *filp, char __user *buffer, size_t length, loff_t *offset) {
-     
-    (wait_event_interruptible(read_waitq, asee_buf_count > 0));
-    int is_control_c = 0;
-    is_control_c = controlCcheck();
-    //si le processus en cours a été reveillé par un signal de control + c on l'interrompt
-    if(is_control_c){
-        module_put(THIS_MODULE); 
-            return -EINTR; 
-    }
-     
-     int bytes_read = 0;
-     int end = asee_buf_count;
-     char *msg_ptr = circular_buffer;
-
-     while (length && end){
-           put_user(msg_ptr[read_index], buffer++);
-           read_index = (read_index  + 1) % asee_buf_size;
-           bytes_read++;
-           length--;
-           end--;
-     }
-     //emptybuffer(circular_buffer, asee_buf_size);
-     asee_buf_count = 0;
-     read_index = 0;
-     write_index = 0;
-     wake_up(&write_waitq);
-     return bytes_read;
- }
+/* Rate limit of each writer in write()s/s, 0 for none */
+static ssize_t asee_rate_records_show(struct kobject *kobj,
+                                      struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(asee_chan_of(kobj)->rate_records));
+}
+
+static ssize_t asee_rate_records_store(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       const char *buf, size_t count)
+{
+    unsigned int rate;
+
+    if (kstrtouint(buf, 0, &rate))
+        return -EINVAL;
+    WRITE_ONCE(asee_chan_of(kobj)->rate_records, rate);
+    return count;
+}
+
+static struct kobj_attribute asee_rate_records_attribute =
+  __ATTR(asee_rate_records, 0660, asee_rate_records_show,
+         asee_rate_records_store);
+
+/* Whether the limits are per process or per cgroup */
+static ssize_t asee_rate_scope_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr, char *buf)
+{
+    enum asee_rate_scope scope = READ_ONCE(asee_chan_of(kobj)->rate_scope);
+    int i, len = 0;
+
+    for (i = 0; i < ARRAY_SIZE(asee_rate_scope_names); i++)
+        len += sprintf(buf + len, i == scope ? "[%s] " : "%s ",
+                       asee_rate_scope_names[i]);
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static ssize_t asee_rate_scope_store(struct kobject *kobj,
+                                     struct kobj_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    int scope = sysfs_match_string(asee_rate_scope_names, buf);
+
+    if (scope < 0)
+        return scope;
+    /* The buckets were kept by the other kind of id */
+    spin_lock(&ch->rate_lock);
+    if (ch->rate_scope != scope) {
+        asee_rate_flush(ch, true);
+        WRITE_ONCE(ch->rate_scope, scope);
+    }
+    spin_unlock(&ch->rate_lock);
+    return count;
+}
+
+static struct kobj_attribute asee_rate_scope_attribute =
+  __ATTR(asee_rate_scope, 0660, asee_rate_scope_show, asee_rate_scope_store);
+
+/* What a write over the limit gets: wait, EAGAIN, or dropped */
+static ssize_t asee_rate_action_show(struct kobject *kobj,
+                                     struct kobj_attribute *attr, char *buf)
+{
+    enum asee_rate_action action = READ_ONCE(asee_chan_of(kobj)->rate_action);
+    int i, len = 0;
+
+    for (i = 0; i < ARRAY_SIZE(asee_rate_action_names); i++)
+        len += sprintf(buf + len, i == action ? "[%s] " : "%s ",
+                       asee_rate_action_names[i]);
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static ssize_t asee_rate_action_store(struct kobject *kobj,
+                                      struct kobj_attribute *attr,
+                                      const char *buf, size_t count)
+{
+    int action = sysfs_match_string(asee_rate_action_names, buf);
+
+    if (action < 0)
+        return action;
+    WRITE_ONCE(asee_chan_of(kobj)->rate_action, action);
+    return count;
+}
+
+static struct kobj_attribute asee_rate_action_attribute =
+  __ATTR(asee_rate_action, 0660, asee_rate_action_show,
+         asee_rate_action_store);
+
+/* Counters of each writer that has a bucket */
+static ssize_t asee_rate_stats_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    struct asee_bucket *b;
+    int len, bkt;
+
+    len = sprintf(buf, "id comm bytes records throttled dropped wait_us\n");
+    spin_lock(&ch->rate_lock);
+    hash_for_each(ch->buckets, bkt, b, node)
+        len += scnprintf(buf + len, PAGE_SIZE - len,
+                         "%llu %s %lu %lu %lu %lu %llu\n", b->id, b->comm,
+                         b->bytes, b->records, b->throttled, b->dropped,
+                         b->wait_ns / NSEC_PER_USEC);
+    spin_unlock(&ch->rate_lock);
+    return len;
+}
+
+static struct kobj_attribute asee_rate_stats_attribute =
+  __ATTR(asee_rate_stats, 0440, asee_rate_stats_show, NULL);
+
+/* Huge pages: whether they were asked for, then whether the ring has them.
+ * The ring is rounded up to whole huge pages, and falls back to base pages
+ * if there are not enough free.
+ */
+static ssize_t asee_huge_pages_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    bool obtained;
+
+    percpu_down_read(&ch->resize_sem);
+    obtained = ch->ring && ch->ring->order;
+    percpu_up_read(&ch->resize_sem);
+
+    return sprintf(buf, "%d %d\n", READ_ONCE(ch->huge), obtained);
+}
+
+static ssize_t asee_huge_pages_store(struct kobject *kobj,
+                                     struct kobj_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    bool huge;
+    int error;
+
+    if (kstrtobool(buf, &huge))
+        return -EINVAL;
+
+    mutex_lock(&ch->replace_lock);
+    WRITE_ONCE(ch->huge, huge);
+    error = ch->ring ? asee_replace_ring(ch, ch->asee_buf_size, ch->node, huge)
+                     : 0;
+    mutex_unlock(&ch->replace_lock);
+    return error ? error : count;
+}
+
+static struct kobj_attribute asee_huge_pages_attribute =
+  __ATTR(asee_huge_pages, 0660, asee_huge_pages_show, asee_huge_pages_store);
+
+/* Size limit of the spill file, in bytes */
+static ssize_t asee_spill_max_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(asee_chan_of(kobj)->spill_max));
+}
+
+static ssize_t asee_spill_max_store(struct kobject *kobj,
+                                    struct kobj_attribute *attr,
+                                    const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned long max;
+
+    if (kstrtoul(buf, 0, &max) || max > MAX_LFS_FILESIZE)
+        return -EINVAL;
+    WRITE_ONCE(ch->spill_max, max);
+    wake_up_interruptible_all(&ch->write_waitq);
+    return count;
+}
+
+static struct kobj_attribute asee_spill_max_attribute =
+  __ATTR(asee_spill_max, 0660, asee_spill_max_show, asee_spill_max_store);
+
+/* Elastic mode, see asee_chunk. asee_buf_size is then the ceiling. Only
+ * switched while the channel is empty.
+ */
+static ssize_t asee_elastic_show(struct kobject *kobj,
+                                 struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(asee_chan_of(kobj)->elastic));
+}
+
+static ssize_t asee_elastic_store(struct kobject *kobj,
+                                  struct kobj_attribute *attr,
+                                  const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    struct asee_ring *ring = NULL;
+    bool elastic;
+    int error = 0;
+
+    if (kstrtobool(buf, &elastic))
+        return -EINVAL;
+
+    mutex_lock(&ch->replace_lock);
+    percpu_down_write(&ch->resize_sem);
+    mutex_lock(&ch->spill_lock);
+    if (ch->elastic != elastic) {
+        /* Spilled bytes count as stored, as for asee_ring_idle() */
+        if (ch->prod_tail != ch->cons_tail || ch->spill_len) {
+            error = -EBUSY;
+        } else {
+            if (ch->ring)
+                ring = asee_ring_detach(ch);
+            WRITE_ONCE(ch->elastic, elastic);
+        }
+    }
+    mutex_unlock(&ch->spill_lock);
+    percpu_up_write(&ch->resize_sem);
+    mutex_unlock(&ch->replace_lock);
+
+    if (ring)
+        asee_ring_put(ring);
+    return error ? error : count;
+}
+
+static struct kobj_attribute asee_elastic_attribute =
+  __ATTR(asee_elastic, 0660, asee_elastic_show, asee_elastic_store);
+
+/* Move the ring to memory of the given node */
+static int asee_move_buffer(struct asee_channel *ch, int node)
+{
+    int error;
+
+    mutex_lock(&ch->replace_lock);
+    if (ch->ring) {
+        error = asee_replace_ring(ch, ch->asee_buf_size, node, ch->huge);
+    } else {
+        WRITE_ONCE(ch->node, node);
+        error = 0;
+    }
+    mutex_unlock(&ch->replace_lock);
+    return error;
+}
+
+static void asee_numa_work_fn(struct work_struct *work)
+{
+    struct asee_channel *ch =
+        container_of(to_delayed_work(work), struct asee_channel, numa_work);
+    long bytes, total = 0, best_bytes = 0;
+    int nid, best = NUMA_NO_NODE;
+
+    for_each_node(nid) {
+        bytes = atomic_long_xchg(&ch->node_bytes[nid], 0);
+        total += bytes;
+        if (bytes > best_bytes) {
+            best_bytes = bytes;
+            best = nid;
+        }
+    }
+
+    /* Only move for a clear majority, so that a ring read evenly from two
+     * nodes does not bounce between them.
+     */
+    if (total >= ASEE_NUMA_MIN_BYTES && best != READ_ONCE(ch->node) &&
+        best_bytes * 4 >= total * 3) {
+        if (!asee_move_buffer(ch, best))
+            pr_info("%s: ring moved to node %d\n", ch->name, best);
+    }
+
+    if (READ_ONCE(ch->node_auto))
+        schedule_delayed_work(&ch->numa_work, ASEE_NUMA_INTERVAL);
+}
+
+/* NUMA placement of the ring: "auto", "any" or a node number, followed by
+ * the node the ring actually is on (-1 while it has none).
+ */
+static ssize_t asee_numa_node_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    int node = READ_ONCE(ch->node);
+    int on;
+
+    percpu_down_read(&ch->resize_sem);
+    on = ch->ring ? page_to_nid(ch->ring->pages[0]) : NUMA_NO_NODE;
+    percpu_up_read(&ch->resize_sem);
+
+    if (READ_ONCE(ch->node_auto))
+        return sprintf(buf, "auto %d\n", on);
+    if (node == NUMA_NO_NODE)
+        return sprintf(buf, "any %d\n", on);
+    return sprintf(buf, "%d %d\n", node, on);
+}
+
+static ssize_t asee_numa_node_store(struct kobject *kobj,
+                                    struct kobj_attribute *attr,
+                                    const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    int node, nid, error;
+
+    if (sysfs_streq(buf, "auto")) {
+        if (!READ_ONCE(ch->node_auto)) {
+            for_each_node(nid)
+                atomic_long_set(&ch->node_bytes[nid], 0);
+            WRITE_ONCE(ch->node_auto, true);
+            schedule_delayed_work(&ch->numa_work, ASEE_NUMA_INTERVAL);
+        }
+        return count;
+    }
+
+    if (sysfs_streq(buf, "any"))
+        node = NUMA_NO_NODE;
+    else if (kstrtoint(buf, 0, &node) || node < 0 || node >= nr_node_ids ||
+             !node_online(node))
+        return -EINVAL;
+
+    WRITE_ONCE(ch->node_auto, false);
+    cancel_delayed_work_sync(&ch->numa_work);
+    error = asee_move_buffer(ch, node);
+    return error ? error : count;
+}
+
+static struct kobj_attribute asee_numa_node_attribute =
+  __ATTR(asee_numa_node, 0660, asee_numa_node_show, asee_numa_node_store);
+
+//fonctions pour lire le nombre de caractereqs presents dans le buffer
+static ssize_t asee_buf_count_show(struct kobject *kobj,
+                               struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", asee_count(asee_chan_of(kobj)));
+}
+
+static ssize_t asee_buf_count_store(struct kobject *kobj,
+                                struct kobj_attribute *attr, char *buf,
+                                size_t count)
+{
+      pr_err("this function is not yet implemented");
+      return -1;
+}
+
+static struct kobj_attribute asee_buf_count_attribute =
+  __ATTR(asee_buf_count, 0660, asee_buf_count_show, (void *)asee_buf_count_store);
+
+/* Overflow policy: the current one is shown between brackets */
+static ssize_t asee_policy_show(struct kobject *kobj,
+                                struct kobj_attribute *attr, char *buf)
+{
+    enum asee_policy policy = READ_ONCE(asee_chan_of(kobj)->policy);
+    int i, len = 0;
+
+    for (i = 0; i < ARRAY_SIZE(asee_policy_names); i++)
+        len += sprintf(buf + len, i == policy ? "[%s] " : "%s ",
+                       asee_policy_names[i]);
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static ssize_t asee_policy_store(struct kobject *kobj,
+                                 struct kobj_attribute *attr,
+                                 const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    int policy = sysfs_match_string(asee_policy_names, buf);
+
+    if (policy < 0)
+        return policy;
+    /* What is spilled must be drained first, to keep the order. Under
+     * spill_lock, so that no writer spills after the check.
+     */
+    percpu_down_read(&ch->resize_sem);
+    mutex_lock(&ch->spill_lock);
+    if (policy != ASEE_POLICY_SPILL && ch->spill_len) {
+        mutex_unlock(&ch->spill_lock);
+        percpu_up_read(&ch->resize_sem);
+        return -EBUSY;
+    }
+    WRITE_ONCE(ch->policy, policy);
+    mutex_unlock(&ch->spill_lock);
+    percpu_up_read(&ch->resize_sem);
+    /* Blocked writers have to notice that they should not block anymore */
+    wake_up_interruptible_all(&ch->write_waitq);
+    return count;
+}
+
+static struct kobj_attribute asee_policy_attribute =
+  __ATTR(asee_policy, 0660, asee_policy_show, asee_policy_store);
+
+/* Synchronization backend, shown like the policy */
+static ssize_t asee_sync_show(struct kobject *kobj,
+                              struct kobj_attribute *attr, char *buf)
+{
+    enum asee_sync sync = READ_ONCE(asee_chan_of(kobj)->sync);
+    int i, len = 0;
+
+    for (i = 0; i < ARRAY_SIZE(asee_sync_names); i++)
+        len += sprintf(buf + len, i == sync ? "[%s] " : "%s ",
+                       asee_sync_names[i]);
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static ssize_t asee_sync_store(struct kobject *kobj,
+                               struct kobj_attribute *attr,
+                               const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    int sync = sysfs_match_string(asee_sync_names, buf);
+
+    if (sync < 0)
+        return sync;
+    /* No transfer is running under the write side */
+    percpu_down_write(&ch->resize_sem);
+    ch->sync = sync;
+    percpu_up_write(&ch->resize_sem);
+    return count;
+}
+
+static struct kobj_attribute asee_sync_attribute =
+  __ATTR(asee_sync, 0660, asee_sync_show, asee_sync_store);
+
+/* Wake-up accounting: how many times a sleeping reader or writer has been
+ * woken, against the number of bytes that went through the channel.
+ */
+static ssize_t asee_stats_show(struct kobject *kobj,
+                               struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    long rw = atomic_long_read(&ch->read_wakeups);
+    long ww = atomic_long_read(&ch->write_wakeups);
+    long br = atomic_long_read(&ch->bytes_read);
+    long bw = atomic_long_read(&ch->bytes_written);
+    long reads = atomic_long_read(&ch->reads);
+    long per_kib = (br + bw) ? (rw + ww) * 1024 * 1000 / (br + bw) : 0;
+
+    return sprintf(buf,
+                   "read_wakeups %ld\n"
+                   "write_wakeups %ld\n"
+                   "bytes_read %ld\n"
+                   "bytes_written %ld\n"
+                   "wakeups_per_kib %ld.%03ld\n"
+                   "reads %ld\n"
+                   "bytes_per_read %ld\n"
+                   "spin_us %llu\n"
+                   "sleep_us %llu\n"
+                   "spin_hits %ld\n"
+                   "spin_misses %ld\n"
+                   "dropped %ld\n"
+                   "drop_events %ld\n"
+                   "gift_pages %ld\n"
+                   "gift_bytes %ld\n"
+                   "chunks %u\n"
+                   "chunks_peak %u\n"
+                   "chunk_grows %ld\n"
+                   "chunk_shrinks %ld\n"
+                   "spill_bytes %lu\n"
+                   "spilled %ld\n"
+                   "refilled %ld\n"
+                   "sync_contended %ld\n",
+                   rw, ww, br, bw, per_kib / 1000, per_kib % 1000,
+                   reads, reads ? br / reads : 0,
+                   (u64)atomic64_read(&ch->spin_ns) / NSEC_PER_USEC,
+                   (u64)atomic64_read(&ch->sleep_ns) / NSEC_PER_USEC,
+                   atomic_long_read(&ch->spin_hits),
+                   atomic_long_read(&ch->spin_misses),
+                   atomic_long_read(&ch->dropped),
+                   atomic_long_read(&ch->drop_events),
+                   atomic_long_read(&ch->gift_pages),
+                   atomic_long_read(&ch->gift_bytes),
+                   READ_ONCE(ch->chunkq.nr_chunks),
+                   READ_ONCE(ch->chunkq.chunks_peak),
+                   atomic_long_read(&ch->chunk_grows),
+                   atomic_long_read(&ch->chunk_shrinks),
+                   READ_ONCE(ch->spill_len),
+                   atomic_long_read(&ch->spilled),
+                   atomic_long_read(&ch->refilled),
+                   atomic_long_read(&ch->sync_contended));
+}
+
+static struct kobj_attribute asee_stats_attribute =
+  __ATTR(asee_stats, 0440, asee_stats_show, NULL);
+
+/* Busy-poll budget in microseconds, 0 to always sleep right away */
+static ssize_t asee_busy_poll_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(asee_chan_of(kobj)->busy_poll_us));
+}
+
+static ssize_t asee_busy_poll_store(struct kobject *kobj,
+                                    struct kobj_attribute *attr,
+                                    const char *buf, size_t count)
+{
+    unsigned int us;
+
+    if (kstrtouint(buf, 0, &us) || us > USEC_PER_SEC)
+        return -EINVAL;
+    WRITE_ONCE(asee_chan_of(kobj)->busy_poll_us, us);
+    return count;
+}
+
+static struct kobj_attribute asee_busy_poll_attribute =
+  __ATTR(asee_busy_poll, 0660, asee_busy_poll_show, asee_busy_poll_store);
+
+static ssize_t asee_strip_newline_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(asee_chan_of(kobj)->strip_nl));
+}
+
+static ssize_t asee_strip_newline_store(struct kobject *kobj,
+                                        struct kobj_attribute *attr,
+                                        const char *buf, size_t count)
+{
+    bool strip;
+
+    if (kstrtobool(buf, &strip))
+        return -EINVAL;
+    WRITE_ONCE(asee_chan_of(kobj)->strip_nl, strip);
+    return count;
+}
+
+static struct kobj_attribute asee_strip_newline_attribute =
+  __ATTR(asee_strip_newline, 0660, asee_strip_newline_show,
+         asee_strip_newline_store);
+
+/* Read thresholds given to the files opened from now on */
+static ssize_t asee_read_min_show(struct kobject *kobj,
+                                  struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(asee_chan_of(kobj)->read_min));
+}
+
+static ssize_t asee_read_min_store(struct kobject *kobj,
+                                   struct kobj_attribute *attr,
+                                   const char *buf, size_t count)
+{
+    unsigned int min;
+
+    if (kstrtouint(buf, 0, &min))
+        return -EINVAL;
+    WRITE_ONCE(asee_chan_of(kobj)->read_min, min);
+    return count;
+}
+
+static struct kobj_attribute asee_read_min_attribute =
+  __ATTR(asee_read_min, 0660, asee_read_min_show, asee_read_min_store);
+
+static ssize_t asee_read_timeout_us_show(struct kobject *kobj,
+                                         struct kobj_attribute *attr,
+                                         char *buf)
+{
+    return sprintf(buf, "%u\n",
+                   READ_ONCE(asee_chan_of(kobj)->read_timeout_us));
+}
+
+static ssize_t asee_read_timeout_us_store(struct kobject *kobj,
+                                          struct kobj_attribute *attr,
+                                          const char *buf, size_t count)
+{
+    unsigned int us;
+
+    if (kstrtouint(buf, 0, &us))
+        return -EINVAL;
+    WRITE_ONCE(asee_chan_of(kobj)->read_timeout_us, us);
+    return count;
+}
+
+static struct kobj_attribute asee_read_timeout_us_attribute =
+  __ATTR(asee_read_timeout_us, 0660, asee_read_timeout_us_show,
+         asee_read_timeout_us_store);
+
+/* Number of gifted buffers (pages) the channel holds at most */
+static ssize_t asee_gift_max_show(struct kobject *kobj,
+                                  struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(asee_chan_of(kobj)->gift_max));
+}
+
+static ssize_t asee_gift_max_store(struct kobject *kobj,
+                                   struct kobj_attribute *attr,
+                                   const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned int max;
+
+    if (kstrtouint(buf, 0, &max) || !max)
+        return -EINVAL;
+    WRITE_ONCE(ch->gift_max, max);
+    wake_up_interruptible_all(&ch->write_waitq);
+    return count;
+}
+
+static struct kobj_attribute asee_gift_max_attribute =
+  __ATTR(asee_gift_max, 0660, asee_gift_max_show, asee_gift_max_store);
+
+/* Fill level, limit, weight and drops of each lane */
+static ssize_t asee_lanes_show(struct kobject *kobj,
+                               struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    long dropped = atomic_long_read(&ch->dropped);
+    int len, l;
+
+    for (l = 1; l < ASEE_NR_LANES; l++)
+        dropped -= atomic_long_read(&ch->lanes[l].dropped);
+
+    len = sprintf(buf, "lane fill max weight dropped\n");
+    len += sprintf(buf + len, "0 %u %u %u %ld\n", asee_count(ch),
+                   READ_ONCE(ch->asee_buf_size),
+                   READ_ONCE(ch->lanes[0].weight), dropped);
+    for (l = 1; l < ASEE_NR_LANES; l++)
+        len += sprintf(buf + len, "%d %lu %lu %u %ld\n", l,
+                       READ_ONCE(ch->lanes[l].q.len),
+                       READ_ONCE(ch->lanes[l].max),
+                       READ_ONCE(ch->lanes[l].weight),
+                       atomic_long_read(&ch->lanes[l].dropped));
+    return len;
+}
+
+static struct kobj_attribute asee_lanes_attribute =
+  __ATTR(asee_lanes, 0440, asee_lanes_show, NULL);
+
+/* How readers pick a lane: strict priority, or weighted-fair */
+static ssize_t asee_lane_mode_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, READ_ONCE(asee_chan_of(kobj)->lanes_fair) ?
+                   "strict [fair]\n" : "[strict] fair\n");
+}
+
+static ssize_t asee_lane_mode_store(struct kobject *kobj,
+                                    struct kobj_attribute *attr,
+                                    const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+
+    if (sysfs_streq(buf, "strict"))
+        WRITE_ONCE(ch->lanes_fair, false);
+    else if (sysfs_streq(buf, "fair"))
+        WRITE_ONCE(ch->lanes_fair, true);
+    else
+        return -EINVAL;
+    return count;
+}
+
+static struct kobj_attribute asee_lane_mode_attribute =
+  __ATTR(asee_lane_mode, 0660, asee_lane_mode_show, asee_lane_mode_store);
+
+/* Weights of the lanes in fair mode, lane 0 first */
+static ssize_t asee_lane_weights_show(struct kobject *kobj,
+                                      struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    int len = 0, l;
+
+    for (l = 0; l < ASEE_NR_LANES; l++)
+        len += sprintf(buf + len, "%u ", READ_ONCE(ch->lanes[l].weight));
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static ssize_t asee_lane_weights_store(struct kobject *kobj,
+                                       struct kobj_attribute *attr,
+                                       const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned int w[ASEE_NR_LANES];
+    int l;
+
+    if (sscanf(buf, "%u %u %u %u", &w[0], &w[1], &w[2], &w[3]) !=
+        ASEE_NR_LANES)
+        return -EINVAL;
+    for (l = 0; l < ASEE_NR_LANES; l++)
+        if (!w[l] || w[l] > 1024)
+            return -EINVAL;
+    for (l = 0; l < ASEE_NR_LANES; l++)
+        WRITE_ONCE(ch->lanes[l].weight, w[l]);
+    return count;
+}
+
+static struct kobj_attribute asee_lane_weights_attribute =
+  __ATTR(asee_lane_weights, 0660, asee_lane_weights_show,
+         asee_lane_weights_store);
+
+/* Limit of each priority lane, in bytes */
+static ssize_t asee_lane_max_show(struct kobject *kobj,
+                                  struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(asee_chan_of(kobj)->lanes[1].max));
+}
+
+static ssize_t asee_lane_max_store(struct kobject *kobj,
+                                   struct kobj_attribute *attr,
+                                   const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned long max;
+    int l;
+
+    if (kstrtoul(buf, 0, &max) || !max)
+        return -EINVAL;
+    for (l = 1; l < ASEE_NR_LANES; l++)
+        WRITE_ONCE(ch->lanes[l].max, max);
+    wake_up_interruptible_all(&ch->write_waitq);
+    return count;
+}
+
+static struct kobj_attribute asee_lane_max_attribute =
+  __ATTR(asee_lane_max, 0660, asee_lane_max_show, asee_lane_max_store);
+
+/* Number of shards of keyed records. It only changes while they are empty. */
+static ssize_t asee_shards_show(struct kobject *kobj,
+                                struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(asee_chan_of(kobj)->nr_shards));
+}
+
+static void asee_group_rebalance(struct asee_channel *ch);
+
+static ssize_t asee_shards_store(struct kobject *kobj,
+                                 struct kobj_attribute *attr,
+                                 const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned int nr;
+    int error = 0, s;
+
+    if (kstrtouint(buf, 0, &nr) || !nr || nr > ASEE_MAX_SHARDS)
+        return -EINVAL;
+
+    down_write(&ch->group_sem);
+    for (s = 0; s < ch->nr_shards; s++)
+        if (ch->shards[s].q.len)
+            error = -EBUSY;
+    if (!error) {
+        WRITE_ONCE(ch->nr_shards, nr);
+        asee_group_rebalance(ch);
+    }
+    up_write(&ch->group_sem);
+    return error ? error : count;
+}
+
+static struct kobj_attribute asee_shards_attribute =
+  __ATTR(asee_shards, 0660, asee_shards_show, asee_shards_store);
+
+/* Limit of each shard, in bytes */
+static ssize_t asee_shard_max_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(asee_chan_of(kobj)->shard_max));
+}
+
+static ssize_t asee_shard_max_store(struct kobject *kobj,
+                                    struct kobj_attribute *attr,
+                                    const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned long max;
+
+    if (kstrtoul(buf, 0, &max) || !max)
+        return -EINVAL;
+    WRITE_ONCE(ch->shard_max, max);
+    wake_up_interruptible_all(&ch->write_waitq);
+    return count;
+}
+
+static struct kobj_attribute asee_shard_max_attribute =
+  __ATTR(asee_shard_max, 0660, asee_shard_max_show, asee_shard_max_store);
+
+/* Shards, their owner and fill, and the consumer group */
+static ssize_t asee_group_show(struct kobject *kobj,
+                               struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    struct asee_shard *shard;
+    int len, s;
+
+    down_read(&ch->group_sem);
+    len = sprintf(buf, "members %d\nrebalances %ld\nshard owner records bytes\n",
+                  bitmap_weight(&ch->members, ASEE_MAX_MEMBERS),
+                  atomic_long_read(&ch->rebalances));
+    for (s = 0; s < ch->nr_shards; s++) {
+        shard = &ch->shards[s];
+        len += sprintf(buf + len, "%d %d %lu %lu\n", s, READ_ONCE(shard->owner),
+                       READ_ONCE(shard->records), READ_ONCE(shard->q.len));
+    }
+    up_read(&ch->group_sem);
+    return len;
+}
+
+static struct kobj_attribute asee_group_attribute =
+  __ATTR(asee_group, 0440, asee_group_show, NULL);
+
+/*
+ * Simulated device interrupt: "N" raises one interrupt that queues N
+ * records (they are dropped once the stage of the CPU is full), "abort"
+ * fails every read and write blocked on the channel.
+ */
+static ssize_t asee_irq_store(struct kobject *kobj,
+                              struct kobj_attribute *attr,
+                              const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned int nr;
+
+    if (sysfs_streq(buf, "abort")) {
+        atomic_inc(&ch->abort_gen);
+        wake_up_interruptible_all(&ch->read_waitq);
+        wake_up_interruptible_all(&ch->write_waitq);
+        return count;
+    }
+    if (kstrtouint(buf, 0, &nr) || !nr || nr > ASEE_IRQ_STAGE)
+        return -EINVAL;
+    atomic_add(nr, &ch->irq_sim_nr);
+    irq_work_queue(&ch->irq_sim);
+    return count;
+}
+
+static struct kobj_attribute asee_irq_attribute =
+  __ATTR(asee_irq, 0220, NULL, asee_irq_store);
+
+static u64 asee_lat_avg(struct asee_lat *lat)
+{
+    long count = atomic_long_read(&lat->count);
+
+    return count ? div64_u64(atomic64_read(&lat->sum_ns), count) : 0;
+}
+
+/* Bytes queued from interrupts, and how long they took to get out */
+static ssize_t asee_irq_stats_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+
+    return sprintf(buf,
+                   "irq_bytes %ld\n"
+                   "irq_dropped %ld\n"
+                   "bh_samples %ld\n"
+                   "bh_latency_avg_ns %llu\n"
+                   "bh_latency_max_ns %llu\n"
+                   "read_samples %ld\n"
+                   "read_latency_avg_ns %llu\n"
+                   "read_latency_max_ns %llu\n",
+                   atomic_long_read(&ch->irq_bytes),
+                   atomic_long_read(&ch->irq_dropped),
+                   atomic_long_read(&ch->irq_bh_lat.count),
+                   asee_lat_avg(&ch->irq_bh_lat),
+                   READ_ONCE(ch->irq_bh_lat.max_ns),
+                   atomic_long_read(&ch->irq_read_lat.count),
+                   asee_lat_avg(&ch->irq_read_lat),
+                   READ_ONCE(ch->irq_read_lat.max_ns));
+}
+
+static struct kobj_attribute asee_irq_stats_attribute =
+  __ATTR(asee_irq_stats, 0440, asee_irq_stats_show, NULL);
+
+/* Refresh period of the status page, in microseconds */
+static ssize_t asee_status_us_show(struct kobject *kobj,
+                                   struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(asee_chan_of(kobj)->status_us));
+}
+
+static ssize_t asee_status_us_store(struct kobject *kobj,
+                                    struct kobj_attribute *attr,
+                                    const char *buf, size_t count)
+{
+    unsigned int us;
+
+    if (kstrtouint(buf, 0, &us) || us < 10 || us > USEC_PER_SEC)
+        return -EINVAL;
+    WRITE_ONCE(asee_chan_of(kobj)->status_us, us);
+    return count;
+}
+
+static struct kobj_attribute asee_status_us_attribute =
+  __ATTR(asee_status_us, 0660, asee_status_us_show, asee_status_us_store);
+
+static int asee_sink_attach(struct asee_channel *ch, const char *path);
+static void asee_sink_detach(struct asee_channel *ch);
+
+/* File the sink writes to: a path to attach it (or move it), none to
+ * detach it.
+ */
+static ssize_t asee_sink_show(struct kobject *kobj,
+                              struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    int len;
+
+    mutex_lock(&ch->sink_lock);
+    len = sprintf(buf, "%s\n", ch->sink_path ? ch->sink_path : "none");
+    mutex_unlock(&ch->sink_lock);
+    return len;
+}
+
+static ssize_t asee_sink_store(struct kobject *kobj,
+                               struct kobj_attribute *attr,
+                               const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    char *copy, *path;
+    int error = 0;
+
+    copy = kstrndup(buf, count, GFP_KERNEL);
+    if (!copy)
+        return -ENOMEM;
+    path = strim(copy);
+
+    mutex_lock(&ch->sink_lock);
+    if (!strcmp(path, "none")) {
+        asee_sink_detach(ch);
+    } else if (path[0] != '/') {
+        error = -EINVAL;
+    } else {
+        asee_sink_detach(ch);
+        error = asee_sink_attach(ch, path);
+    }
+    mutex_unlock(&ch->sink_lock);
+    kfree(copy);
+    return error ? error : count;
+}
+
+static struct kobj_attribute asee_sink_attribute =
+  __ATTR(asee_sink, 0660, asee_sink_show, asee_sink_store);
+
+/* Largest batch of the sink, in bytes. Set while it is detached. */
+static ssize_t asee_sink_batch_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(asee_chan_of(kobj)->sink_batch));
+}
+
+static ssize_t asee_sink_batch_store(struct kobject *kobj,
+                                     struct kobj_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned int batch;
+    int error = 0;
+
+    if (kstrtouint(buf, 0, &batch) || batch < PAGE_SIZE ||
+        batch > ASEE_SINK_MAX_BATCH)
+        return -EINVAL;
+
+    mutex_lock(&ch->sink_lock);
+    if (ch->sink_task)
+        error = -EBUSY;
+    else
+        WRITE_ONCE(ch->sink_batch, batch);
+    mutex_unlock(&ch->sink_lock);
+    return error ? error : count;
+}
+
+static struct kobj_attribute asee_sink_batch_attribute =
+  __ATTR(asee_sink_batch, 0660, asee_sink_batch_show, asee_sink_batch_store);
+
+/* Milliseconds between two fsyncs of the sink, 0 for none */
+static ssize_t asee_sink_fsync_ms_show(struct kobject *kobj,
+                                       struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(asee_chan_of(kobj)->sink_fsync_ms));
+}
+
+static ssize_t asee_sink_fsync_ms_store(struct kobject *kobj,
+                                        struct kobj_attribute *attr,
+                                        const char *buf, size_t count)
+{
+    unsigned int ms;
+
+    if (kstrtouint(buf, 0, &ms))
+        return -EINVAL;
+    WRITE_ONCE(asee_chan_of(kobj)->sink_fsync_ms, ms);
+    return count;
+}
+
+static struct kobj_attribute asee_sink_fsync_ms_attribute =
+  __ATTR(asee_sink_fsync_ms, 0660, asee_sink_fsync_ms_show,
+         asee_sink_fsync_ms_store);
+
+/* What the sink wrote, and how far behind the writers it is: lag_bytes
+ * are in lane 0 still, which it drains in lag_us at its current rate.
+ */
+static ssize_t asee_sink_stats_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    unsigned long rate = READ_ONCE(ch->sink_rate);
+    unsigned long lag;
+
+    lag = smp_load_acquire(&ch->prod_tail) - READ_ONCE(ch->cons_tail);
+    return sprintf(buf, "bytes %ld\nbatches %ld\nfsyncs %ld\nerrors %ld\n"
+                   "last_error %d\nrate %lu\nlag_bytes %lu\nlag_us %llu\n",
+                   atomic_long_read(&ch->sink_bytes),
+                   atomic_long_read(&ch->sink_batches),
+                   atomic_long_read(&ch->sink_fsyncs),
+                   atomic_long_read(&ch->sink_errors),
+                   READ_ONCE(ch->sink_error), rate, lag,
+                   rate ? div64_ul((u64)lag * USEC_PER_SEC, rate) : 0);
+}
+
+static struct kobj_attribute asee_sink_stats_attribute =
+  __ATTR(asee_sink_stats, 0440, asee_sink_stats_show, NULL);
+
+/* Time the readers and writers slept, by scheduling class */
+static ssize_t asee_wait_stats_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr, char *buf)
+{
+    struct asee_channel *ch = asee_chan_of(kobj);
+    struct asee_lat *lat;
+    int len, side, c;
+
+    len = sprintf(buf, "side class waits avg_us max_us\n");
+    for (side = 0; side < 2; side++) {
+        for (c = 0; c < ASEE_NR_WCLASS; c++) {
+            lat = &ch->wait_lat[side][c];
+            len += sprintf(buf + len, "%s %s %ld %llu %llu\n",
+                           side ? "write" : "read", asee_wclass_names[c],
+                           atomic_long_read(&lat->count),
+                           asee_lat_avg(lat) / NSEC_PER_USEC,
+                           READ_ONCE(lat->max_ns) / NSEC_PER_USEC);
+        }
+    }
+    return len;
+}
+
+static struct kobj_attribute asee_wait_stats_attribute =
+  __ATTR(asee_wait_stats, 0440, asee_wait_stats_show, NULL);
+
+static struct attribute *asee_attrs[] = {
+    &asee_buf_size_attribute.attr,
+    &asee_rate_bytes_attribute.attr,
+    &asee_rate_records_attribute.attr,
+    &asee_rate_scope_attribute.attr,
+    &asee_rate_action_attribute.attr,
+    &asee_rate_stats_attribute.attr,
+    &asee_buf_count_attribute.attr,
+    &asee_policy_attribute.attr,
+    &asee_sync_attribute.attr,
+    &asee_stats_attribute.attr,
+    &asee_busy_poll_attribute.attr,
+    &asee_strip_newline_attribute.attr,
+    &asee_read_min_attribute.attr,
+    &asee_read_timeout_us_attribute.attr,
+    &asee_numa_node_attribute.attr,
+    &asee_huge_pages_attribute.attr,
+    &asee_gift_max_attribute.attr,
+    &asee_elastic_attribute.attr,
+    &asee_spill_max_attribute.attr,
+    &asee_lanes_attribute.attr,
+    &asee_lane_mode_attribute.attr,
+    &asee_lane_weights_attribute.attr,
+    &asee_lane_max_attribute.attr,
+    &asee_shards_attribute.attr,
+    &asee_shard_max_attribute.attr,
+    &asee_group_attribute.attr,
+    &asee_irq_attribute.attr,
+    &asee_irq_stats_attribute.attr,
+    &asee_status_us_attribute.attr,
+    &asee_sink_attribute.attr,
+    &asee_sink_batch_attribute.attr,
+    &asee_sink_fsync_ms_attribute.attr,
+    &asee_sink_stats_attribute.attr,
+    &asee_wait_stats_attribute.attr,
+    NULL,
+};
+
+static const struct attribute_group asee_attr_group = {
+    .attrs = asee_attrs,
+};
+
+/*
+ * /proc/asee_mod: one line per channel. It is a seq_file, so it is streamed
+ * page by page however many channels there are, and it only reads
+ * counters: monitoring can read it as often as it likes without getting in
+ * the way of the channels.
+ */
+static void *asee_seq_start(struct seq_file *m, loff_t *pos)
+{
+    if (!*pos)
+        return SEQ_START_TOKEN;
+    return *pos <= nr_channels ? asee_chans[*pos - 1] : NULL;
+}
+
+static void *asee_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    ++*pos;
+    return asee_seq_start(m, pos);
+}
+
+static void asee_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+/* Refresh the throughput of the channel if the last figures are more than
+ * a second old. Concurrent readers may both do it, which is harmless.
+ */
+static void asee_update_rates(struct asee_channel *ch)
+{
+    u64 now = ktime_get_ns();
+    u64 then = READ_ONCE(ch->rate_ns);
+    long written = atomic_long_read(&ch->bytes_written);
+    long read = atomic_long_read(&ch->bytes_read);
+
+    if (now - then < NSEC_PER_SEC)
+        return;
+    if (then) {
+        WRITE_ONCE(ch->write_rate,
+                   div64_u64((u64)(written - READ_ONCE(ch->rate_written)) *
+                             NSEC_PER_SEC, now - then));
+        WRITE_ONCE(ch->read_rate,
+                   div64_u64((u64)(read - READ_ONCE(ch->rate_read)) *
+                             NSEC_PER_SEC, now - then));
+    }
+    WRITE_ONCE(ch->rate_written, written);
+    WRITE_ONCE(ch->rate_read, read);
+    WRITE_ONCE(ch->rate_ns, now);
+}
+
+static int asee_seq_show(struct seq_file *m, void *v)
+{
+    struct asee_channel *ch = v;
+    unsigned int count, size;
+
+    if (v == SEQ_START_TOKEN) {
+        seq_puts(m, "name size count fill% policy write_Bps read_Bps "
+                    "readers_waiting writers_waiting dropped\n");
+        return 0;
+    }
+
+    asee_update_rates(ch);
+    count = asee_count(ch);
+    size = READ_ONCE(ch->asee_buf_size);
+    seq_printf(m, "%s %u %u %u %s %lu %lu %d %d %ld\n", ch->name, size,
+               count, size ? (unsigned int)((u64)count * 100 / size) : 0,
+               asee_policy_names[READ_ONCE(ch->policy)],
+               READ_ONCE(ch->write_rate), READ_ONCE(ch->read_rate),
+               atomic_read(&ch->read_waiters), atomic_read(&ch->write_waiters),
+               atomic_long_read(&ch->dropped));
+    return 0;
+}
+
+static const struct seq_operations asee_seq_ops = {
+    .start = asee_seq_start,
+    .next = asee_seq_next,
+    .stop = asee_seq_stop,
+    .show = asee_seq_show,
+};
+
+/*
+ * Rings are allocated on the first write, and given back under memory
+ * pressure once their channel is empty and has seen no reads nor writes
+ * for idle_secs. A mapped ring is left alone. The next write allocates a
+ * new one.
+ */
+static bool asee_ring_idle(struct asee_channel *ch)
+{
+    u64 last = max(READ_ONCE(ch->last_read_ns), READ_ONCE(ch->last_write_ns));
+    bool idle;
+
+    if (READ_ONCE(ch->prod_head) != READ_ONCE(ch->cons_tail) ||
+        READ_ONCE(ch->spill_len) ||
+        ktime_get_ns() - last < (u64)READ_ONCE(idle_secs) * NSEC_PER_SEC)
+        return false;
+
+    spin_lock(&ch->ring_lock);
+    idle = ch->ring && kref_read(&ch->ring->ref) == 1;
+    spin_unlock(&ch->ring_lock);
+    return idle;
+}
+
+static void asee_release_work_fn(struct work_struct *work)
+{
+    struct asee_channel *ch =
+        container_of(work, struct asee_channel, release_work);
+    struct asee_ring *ring = NULL;
+
+    mutex_lock(&ch->replace_lock);
+    percpu_down_write(&ch->resize_sem);
+    if (asee_ring_idle(ch) && ch->prod_tail == ch->cons_head)
+        ring = asee_ring_detach(ch);
+    percpu_up_write(&ch->resize_sem);
+    mutex_unlock(&ch->replace_lock);
+
+    if (ring)
+        asee_ring_put(ring);
+}
+
+static unsigned long asee_shrink_count(struct shrinker *shrink,
+                                       struct shrink_control *sc)
+{
+    unsigned long pages = 0;
+    int i;
+
+    for (i = 0; i < nr_channels; i++)
+        if (asee_ring_idle(asee_chans[i]))
+            pages += READ_ONCE(asee_chans[i]->ring_size) >> PAGE_SHIFT;
+    return pages ? pages : SHRINK_EMPTY;
+}
+
+/* Freeing a ring waits for the transfers in progress (resize_sem), which
+ * is not for reclaim context: it is done by a work item.
+ */
+static unsigned long asee_shrink_scan(struct shrinker *shrink,
+                                      struct shrink_control *sc)
+{
+    unsigned long pages = 0;
+    int i;
+
+    for (i = 0; i < nr_channels && pages < sc->nr_to_scan; i++) {
+        if (!asee_ring_idle(asee_chans[i]))
+            continue;
+        if (schedule_work(&asee_chans[i]->release_work))
+            pages += READ_ONCE(asee_chans[i]->ring_size) >> PAGE_SHIFT;
+    }
+    return pages ? pages : SHRINK_STOP;
+}
+
+/* Shrinkers are allocated by the kernel since 6.7 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *asee_shrinker;
+#else
+static struct shrinker asee_shrinker = {
+    .count_objects = asee_shrink_count,
+    .scan_objects = asee_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+#endif
+
+static int asee_shrinker_register(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    asee_shrinker = shrinker_alloc(0, DEVICE_NAME);
+    if (!asee_shrinker)
+        return -ENOMEM;
+    asee_shrinker->count_objects = asee_shrink_count;
+    asee_shrinker->scan_objects = asee_shrink_scan;
+    asee_shrinker->seeks = DEFAULT_SEEKS;
+    shrinker_register(asee_shrinker);
+    return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(&asee_shrinker, DEVICE_NAME);
+#else
+    return register_shrinker(&asee_shrinker);
+#endif
+}
+
+static void asee_shrinker_unregister(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_free(asee_shrinker);
+#else
+    unregister_shrinker(&asee_shrinker);
+#endif
+}
+
+static void asee_gift_free_all(struct asee_channel *ch);
+static void asee_irq_bh_fn(struct work_struct *work);
+static void asee_irq_sim_fn(struct irq_work *work);
+static enum hrtimer_restart asee_status_timer_fn(struct hrtimer *timer);
+
+static void asee_channel_destroy(struct asee_channel *ch)
+{
+    struct asee_chunk *c, *next;
+    int i;
+
+    if (ch->kobj) {
+        sysfs_remove_group(ch->kobj, &asee_attr_group);
+        if (ch->kobj != mymodule)
+            kobject_put(ch->kobj);
+    }
+    WRITE_ONCE(ch->node_auto, false);
+    mutex_lock(&ch->sink_lock);
+    asee_sink_detach(ch);
+    mutex_unlock(&ch->sink_lock);
+    cancel_delayed_work_sync(&ch->numa_work);
+    irq_work_sync(&ch->irq_sim);
+    cancel_work_sync(&ch->irq_bh);
+    hrtimer_cancel(&ch->status_timer);
+    free_page((unsigned long)ch->status);
+    spin_lock(&ch->rate_lock);
+    asee_rate_flush(ch, true);
+    spin_unlock(&ch->rate_lock);
+    free_percpu(ch->irq_stage);
+    kfree(ch->irq_bounce);
+    cancel_work_sync(&ch->release_work);
+    list_for_each_entry_safe(c, next, &ch->chunkq.chunks, list)
+        kmem_cache_free(asee_chunk_cache, c);
+    for (i = 1; i < ASEE_NR_LANES; i++)
+        list_for_each_entry_safe(c, next, &ch->lanes[i].q.chunks, list)
+            kmem_cache_free(asee_chunk_cache, c);
+    for (i = 0; i < ASEE_MAX_SHARDS; i++)
+        list_for_each_entry_safe(c, next, &ch->shards[i].q.chunks, list)
+            kmem_cache_free(asee_chunk_cache, c);
+    if (ch->spill_file) {
+        fput(ch->spill_file);
+        free_page((unsigned long)ch->spill_page);
+    }
+    percpu_free_rwsem(&ch->resize_sem);
+    kfree(ch->node_bytes);
+    asee_gift_free_all(ch);
+    if (ch->ring)
+        asee_ring_put(ch->ring);
+    kfree(ch);
+}
+
+static struct asee_channel *asee_channel_create(int minor, int sync)
+{
+    struct asee_channel *ch;
+    int error, i;
+
+    ch = kzalloc_node(sizeof(*ch), GFP_KERNEL, numa_node);
+    if (!ch)
+        return NULL;
+
+    if (minor)
+        snprintf(ch->name, sizeof(ch->name), DEVICE_NAME "%d", minor);
+    else
+        strscpy(ch->name, DEVICE_NAME, sizeof(ch->name));
+    ch->minor = minor;
+    ch->policy = ASEE_POLICY_BLOCK;
+    ch->sync = sync;
+    spin_lock_init(&ch->rate_lock);
+    hash_init(ch->buckets);
+    spin_lock_init(&ch->sync_spin);
+    mutex_init(&ch->sync_mutex);
+    ch->node = numa_node;
+    INIT_DELAYED_WORK(&ch->numa_work, asee_numa_work_fn);
+    spin_lock_init(&ch->gift_lock);
+    INIT_LIST_HEAD(&ch->gifts);
+    ch->gift_max = ASEE_GIFT_MAX;
+
+    //on initialise le buffer
+    //le buffer n'est alloue qu'a la premiere ecriture
+    mutex_init(&ch->replace_lock);
+    spin_lock_init(&ch->ring_lock);
+    INIT_WORK(&ch->release_work, asee_release_work_fn);
+    mutex_init(&ch->elastic_lock);
+    INIT_LIST_HEAD(&ch->chunkq.chunks);
+    spin_lock_init(&ch->lane_lock);
+    for (i = 0; i < ASEE_NR_LANES; i++) {
+        mutex_init(&ch->lanes[i].lock);
+        INIT_LIST_HEAD(&ch->lanes[i].q.chunks);
+        ch->lanes[i].max = ASEE_LANE_MAX;
+        ch->lanes[i].weight = 1;
+    }
+    init_rwsem(&ch->group_sem);
+    for (i = 0; i < ASEE_MAX_SHARDS; i++) {
+        mutex_init(&ch->shards[i].lock);
+        INIT_LIST_HEAD(&ch->shards[i].q.chunks);
+        ch->shards[i].owner = -1;
+    }
+    ch->nr_shards = ASEE_SHARDS;
+    ch->shard_max = ASEE_SHARD_MAX;
+    mutex_init(&ch->spill_lock);
+    ch->spill_max = ASEE_SPILL_MAX;
+    ch->node_bytes = kcalloc_node(nr_node_ids, sizeof(*ch->node_bytes),
+                                  GFP_KERNEL, numa_node);
+    if (!ch->node_bytes) {
+        kfree(ch);
+        return NULL;
+    }
+    ch->asee_buf_size = BUF_LEN;
+    if (percpu_init_rwsem(&ch->resize_sem)) {
+        kfree(ch->node_bytes);
+        kfree(ch);
+        return NULL;
+    }
+    init_waitqueue_head(&ch->read_waitq);
+    init_waitqueue_head(&ch->write_waitq);
+
+    INIT_WORK(&ch->irq_bh, asee_irq_bh_fn);
+    ch->irq_sim = IRQ_WORK_INIT_HARD(asee_irq_sim_fn);
+    hrtimer_init(&ch->status_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    ch->status_timer.function = asee_status_timer_fn;
+    ch->status_us = ASEE_STATUS_US;
+    mutex_init(&ch->sink_lock);
+    ch->sink_batch = ASEE_SINK_BATCH;
+    ch->sink_fsync_ms = ASEE_SINK_FSYNC_MS;
+    ch->irq_stage = alloc_percpu(struct asee_irq_stage);
+    ch->irq_bounce = kmalloc_node(ASEE_IRQ_STAGE, GFP_KERNEL, numa_node);
+    ch->status = (struct asee_status *)get_zeroed_page(GFP_KERNEL);
+    if (!ch->irq_stage || !ch->irq_bounce || !ch->status) {
+        asee_channel_destroy(ch);
+        return NULL;
+    }
+    for_each_possible_cpu(i)
+        raw_spin_lock_init(&per_cpu_ptr(ch->irq_stage, i)->lock);
+
+    ch->kobj = minor ? kobject_create_and_add(ch->name, mymodule) : mymodule;
+    if (!ch->kobj) {
+        asee_channel_destroy(ch);
+        return NULL;
+    }
+    error = sysfs_create_group(ch->kobj, &asee_attr_group);
+    if (error) {
+        pr_info("failed to create the sysfs files of %s\n", ch->name);
+        if (minor)
+            kobject_put(ch->kobj);
+        ch->kobj = NULL;
+        asee_channel_destroy(ch);
+        return NULL;
+    }
+
+    device_create(cls, NULL, MKDEV(major, minor), NULL, "%s", ch->name);
+    return ch;
+}
+
+static int __init chardev_init(void)
+{
+    int sync[ASEE_MAX_CHANNELS];
+    int i;
+
+    if (nr_channels < 1 || nr_channels > ASEE_MAX_CHANNELS) {
+        pr_err("nr_channels must be between 1 and %d\n", ASEE_MAX_CHANNELS);
+        return -EINVAL;
+    }
+    if (numa_node != NUMA_NO_NODE &&
+        (numa_node < 0 || numa_node >= nr_node_ids || !node_online(numa_node))) {
+        pr_err("numa_node %d is not an online node\n", numa_node);
+        return -EINVAL;
+    }
+    for (i = 0; i < nr_channels; i++) {
+        const char *name = nr_sync_backend ?
+            sync_backend[min(i, nr_sync_backend - 1)] : "lockfree";
+
+        sync[i] = match_string(asee_sync_names, ARRAY_SIZE(asee_sync_names),
+                               name);
+        if (sync[i] < 0) {
+            pr_err("unknown sync backend %s\n", name);
+            return -EINVAL;
+        }
+    }
+
+    major = register_chrdev(0, DEVICE_NAME, &chardev_fops);
+
+    if (major < 0) {
+        pr_alert("Registering char device failed with %d\n", major);
+        return major;
+    }
+
+    pr_info("I was assigned major number %d.\n", major);
+
+    asee_chunk_cache = kmem_cache_create("asee_chunk", ASEE_CHUNK_SIZE, 0,
+                                         SLAB_ACCOUNT, NULL);
+    if (!asee_chunk_cache) {
+        unregister_chrdev(major, DEVICE_NAME);
+        return -ENOMEM;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    cls = class_create(DEVICE_NAME);
+#else
+    cls = class_create(THIS_MODULE, DEVICE_NAME);
+#endif
+
+    pr_info("mymodule: initialised\n");
+
+    mymodule = kobject_create_and_add("mymodule", kernel_kobj);
+    if (!mymodule)
+        goto err_class;
+
+    for (i = 0; i < nr_channels; i++) {
+        asee_chans[i] = asee_channel_create(i, sync[i]);
+        if (!asee_chans[i])
+            goto err_channels;
+    }
+
+    if (!proc_create_seq(DEVICE_NAME, 0444, NULL, &asee_seq_ops))
+        goto err_channels;
+
+    if (asee_shrinker_register())
+        goto err_proc;
+    return SUCCESS;
+
+err_proc:
+    remove_proc_entry(DEVICE_NAME, NULL);
+err_channels:
+    while (i--) {
+        device_destroy(cls, MKDEV(major, i));
+        asee_channel_destroy(asee_chans[i]);
+    }
+    kobject_put(mymodule);
+err_class:
+    class_destroy(cls);
+    kmem_cache_destroy(asee_chunk_cache);
+    unregister_chrdev(major, DEVICE_NAME);
+    return -ENOMEM;
+}
+
+static void __exit chardev_exit(void)
+{
+    int i;
+
+    asee_shrinker_unregister();
+    remove_proc_entry(DEVICE_NAME, NULL);
+    for (i = 0; i < nr_channels; i++) {
+        device_destroy(cls, MKDEV(major, i));
+        //on libere le tampon circulaire
+        asee_channel_destroy(asee_chans[i]);
+    }
+    class_destroy(cls);
+    kmem_cache_destroy(asee_chunk_cache);
+
+    pr_info("mymodule: Exit success\n");
+    kobject_put(mymodule);
+    /* Unregister the device */
+    unregister_chrdev(major, DEVICE_NAME);
+}
+
+/* Methods */
+
+/* Are there at least want bytes of stored data that no reader has
+ * reserved yet, in lane 0 or in the priority lanes?
+ */
+static bool asee_readable(struct asee_channel *ch, unsigned int want)
+{
+    return smp_load_acquire(&ch->prod_tail) - READ_ONCE(ch->cons_head) >=
+           want || atomic_long_read(&ch->lanes_len) >= want;
+}
+
+/* Can a read() go on: data in the ring or lanes, or some to refill from
+ * the spill file?
+ */
+static bool asee_read_ready(struct asee_channel *ch, unsigned int want)
+{
+    return asee_readable(ch, want) || READ_ONCE(ch->spill_len);
+}
+
+/* Is there free space that no writer has reserved yet? */
+static bool asee_writable(struct asee_channel *ch, unsigned int want)
+{
+    return READ_ONCE(ch->prod_head) - smp_load_acquire(&ch->cons_tail) <
+           READ_ONCE(ch->asee_buf_size);
+}
+
+/* A writer can go on when there is space or when it does not block */
+static bool asee_write_ready(struct asee_channel *ch, unsigned int want)
+{
+    enum asee_policy policy = READ_ONCE(ch->policy);
+
+    /* Elastic channels do not spill, they block */
+    if (policy == ASEE_POLICY_SPILL && READ_ONCE(ch->elastic))
+        return asee_writable(ch, want);
+    if (policy == ASEE_POLICY_SPILL)
+        return asee_writable(ch, want) ||
+               READ_ONCE(ch->spill_len) < READ_ONCE(ch->spill_max);
+    return asee_writable(ch, want) || policy != ASEE_POLICY_BLOCK;
+}
+
+/*
+ * Reserve up to want bytes of free space, starting at *pos. Returns the
+ * number of bytes reserved, 0 if the ring is full.
+ */
+static unsigned int asee_prod_reserve(struct asee_channel *ch,
+                                      unsigned int want, unsigned long *pos)
+{
+    unsigned long head, space;
+    unsigned int n;
+
+    do {
+        head = READ_ONCE(ch->prod_head);
+        space = ch->asee_buf_size - (head - smp_load_acquire(&ch->cons_tail));
+        /* space is garbage if head is stale, but then the cmpxchg fails */
+        n = min_t(unsigned long, want, space);
+        if (!n)
+            return 0;
+    } while (cmpxchg(&ch->prod_head, head, head + n) != head);
+
+    *pos = head;
+    return n;
+}
+
+/* Publish [pos, pos + n) once the producers before us have published */
+static void asee_prod_commit(struct asee_channel *ch, unsigned long pos,
+                             unsigned int n)
+{
+    while (READ_ONCE(ch->prod_tail) != pos)
+        cpu_relax();
+    smp_store_release(&ch->prod_tail, pos + n);
+}
+
+/* asee_prod_reserve() of exactly want bytes, or nothing */
+static bool asee_prod_reserve_all(struct asee_channel *ch, unsigned int want,
+                                  unsigned long *pos)
+{
+    unsigned long head, space;
+
+    do {
+        head = READ_ONCE(ch->prod_head);
+        space = ch->asee_buf_size - (head - smp_load_acquire(&ch->cons_tail));
+        if (space < want || space > ch->asee_buf_size)
+            return false;
+    } while (cmpxchg(&ch->prod_head, head, head + want) != head);
+
+    *pos = head;
+    return true;
+}
+
+/* Same as asee_prod_reserve(), for up to want bytes of stored data */
+static unsigned int asee_cons_reserve(struct asee_channel *ch,
+                                      unsigned int want, unsigned long *pos)
+{
+    unsigned long head, avail;
+    unsigned int n;
+
+    do {
+        head = READ_ONCE(ch->cons_head);
+        avail = smp_load_acquire(&ch->prod_tail) - head;
+        n = min_t(unsigned long, want, avail);
+        if (!n)
+            return 0;
+    } while (cmpxchg(&ch->cons_head, head, head + n) != head);
+
+    *pos = head;
+    return n;
+}
+
+static void asee_cons_commit(struct asee_channel *ch, unsigned long pos,
+                             unsigned int n)
+{
+    while (READ_ONCE(ch->cons_tail) != pos)
+        cpu_relax();
+    smp_store_release(&ch->cons_tail, pos + n);
+}
+
+/* Address of the byte at position pos: the n bytes from there are
+ * contiguous for any n up to ring_size, the ring being mapped twice.
+ */
+static char *asee_ring_ptr(struct asee_channel *ch, unsigned long pos)
+{
+    return ch->circular_buffer + pos % ch->ring_size;
+}
+
+static void asee_account_drop(struct asee_channel *ch, unsigned long n)
+{
+    atomic_long_add(n, &ch->dropped);
+    atomic_long_inc(&ch->drop_events);
+}
+
+/*
+ * Make room for a writer of the overwrite-oldest policy: it reserves the
+ * oldest bytes like a reader would, and throws them away. Going through
+ * the consumer protocol means a reader still copying older bytes is never
+ * overwritten under its feet.
+ */
+static void asee_drop_oldest(struct asee_channel *ch, unsigned int n)
+{
+    unsigned long pos;
+
+    n = asee_cons_reserve(ch, n, &pos);
+    if (n) {
+        asee_cons_commit(ch, pos, n);
+        asee_account_drop(ch, n);
+    }
+}
+
+/*
+ * Store up to len bytes (at most ASEE_MAX_CHUNK) from user space (or from
+ * kernel space if from_user is false), following the overflow policy of
+ * the channel. Returns the number of bytes consumed from the source, stored
+ * or dropped, 0 if the writer has to wait for space, or an error. Called
+ * under the read side of resize_sem.
+ *
+ * User bytes are copied to a bounce buffer before the reservation, with
+ * page faults allowed: a page reclaimed or migrated after it was faulted
+ * in is brought back, where a copy inside the reservation could only fail
+ * with a range that has to be published anyway.
+ */
+static ssize_t asee_write_chunk(struct asee_channel *ch,
+                                const char __user *from, size_t len,
+                                bool from_user)
+{
+    const struct asee_sync_ops *sync = &asee_sync_backends[ch->sync];
+    enum asee_policy policy = READ_ONCE(ch->policy);
+    const char *src = (__force const char *)from;
+    char *bounce = NULL;
+    size_t consumed = 0;
+    unsigned long pos;
+    ssize_t ret;
+    unsigned int n;
+
+    if (from_user) {
+        bounce = kvmalloc(len, GFP_KERNEL);
+        if (!bounce)
+            return -ENOMEM;
+        len -= copy_from_user(bounce, from, len);
+        if (!len) {
+            kvfree(bounce);
+            return -EFAULT;
+        }
+        src = bounce;
+    }
+
+    /* Only the last asee_buf_size bytes of the write can survive */
+    if (policy == ASEE_POLICY_OVERWRITE_OLDEST && len > ch->asee_buf_size) {
+        consumed = len - ch->asee_buf_size;
+        asee_account_drop(ch, consumed);
+        src += consumed;
+        len = ch->asee_buf_size;
+    }
+
+    sync->lock(ch);
+    n = asee_prod_reserve(ch, len, &pos);
+    if (!n && policy == ASEE_POLICY_OVERWRITE_OLDEST) {
+        do {
+            asee_drop_oldest(ch, len);
+            n = asee_prod_reserve(ch, len, &pos);
+        } while (!n);
+    }
+    if (!n) {
+        sync->unlock(ch);
+        if (policy == ASEE_POLICY_DROP_NEWEST) {
+            asee_account_drop(ch, len);
+            ret = consumed + len;
+        } else {
+            ret = consumed;
+        }
+        goto out;
+    }
+
+    memcpy(asee_ring_ptr(ch, pos), src, n);
+    asee_prod_commit(ch, pos, n);
+    sync->unlock(ch);
+    atomic_long_add(n, &ch->bytes_written);
+
+    if (n < len && policy == ASEE_POLICY_DROP_NEWEST) {
+        asee_account_drop(ch, len - n);
+        ret = consumed + len;
+    } else {
+        ret = consumed + n;
+    }
+out:
+    kvfree(bounce);
+    return ret;
+}
+
+/*
+ * Spill policy: once the ring is full, writes go on into a shmem file, and
+ * are moved back to the ring, in order, as it drains. While anything is
+ * spilled, new writes are appended to the file as well, so that the order
+ * is kept. Both directions go through spill_page, a page at a time, under
+ * spill_lock, taken inside the read side of resize_sem. The spilled pages
+ * can be swapped out, and are given back as they are moved to the ring.
+ */
+
+/* Move spilled data back to the ring, as much as fits */
+static void asee_spill_refill(struct asee_channel *ch)
+{
+    struct inode *inode;
+    unsigned long used, space;
+    loff_t pos, done;
+    ssize_t n;
+
+    lockdep_assert_held(&ch->spill_lock);
+    if (!ch->spill_len || !ch->circular_buffer)
+        return;
+    inode = file_inode(ch->spill_file);
+
+    while (ch->spill_len) {
+        used = ch->prod_head - smp_load_acquire(&ch->cons_tail);
+        space = used < ch->asee_buf_size ? ch->asee_buf_size - used : 0;
+        n = min3(ch->spill_len, PAGE_SIZE, space);
+        if (!n)
+            break;
+
+        pos = ch->spill_rpos;
+        n = kernel_read(ch->spill_file, ch->spill_page, n, &ch->spill_rpos);
+        if (n <= 0)
+            break;
+        /* We are the only producer while something is spilled */
+        done = asee_write_chunk(ch, (__force const char __user *)ch->spill_page,
+                                n, false);
+        if (done <= 0) {
+            ch->spill_rpos = pos;
+            break;
+        }
+        ch->spill_rpos = pos + done;
+        WRITE_ONCE(ch->spill_len, ch->spill_len - done);
+        atomic_long_add(done, &ch->refilled);
+    }
+
+    if (!ch->spill_len) {
+        shmem_truncate_range(inode, 0, (loff_t)-1);
+        ch->spill_rpos = ch->spill_wpos = ch->spill_freed = 0;
+    } else if (round_down(ch->spill_rpos, PAGE_SIZE) > ch->spill_freed) {
+        /* Give back the pages that were read */
+        shmem_truncate_range(inode, ch->spill_freed,
+                             round_down(ch->spill_rpos, PAGE_SIZE) - 1);
+        ch->spill_freed = round_down(ch->spill_rpos, PAGE_SIZE);
+    }
+}
+
+/* Append to the spill file. Returns the number of bytes spilled, 0 if the
+ * file is at spill_max, or an error.
+ */
+static ssize_t asee_spill_append(struct asee_channel *ch,
+                                 const char __user *from, size_t len,
+                                 bool from_user)
+{
+    struct file *file;
+    size_t done = 0, n;
+    ssize_t ret = 0;
+
+    lockdep_assert_held(&ch->spill_lock);
+    if (!ch->spill_file) {
+        ch->spill_page = (char *)__get_free_page(GFP_KERNEL_ACCOUNT);
+        if (!ch->spill_page)
+            return -ENOMEM;
+        file = shmem_file_setup(ch->name, 0, VM_NORESERVE);
+        if (IS_ERR(file)) {
+            free_page((unsigned long)ch->spill_page);
+            ch->spill_page = NULL;
+            return PTR_ERR(file);
+        }
+        ch->spill_file = file;
+    }
+
+    len = min_t(size_t, len, READ_ONCE(ch->spill_max) - min(ch->spill_len,
+                                                    READ_ONCE(ch->spill_max)));
+    while (done < len) {
+        n = min_t(size_t, len - done, PAGE_SIZE);
+        if (!from_user)
+            memcpy(ch->spill_page, (__force const char *)from + done, n);
+        else if (copy_from_user(ch->spill_page, from + done, n)) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = kernel_write(ch->spill_file, ch->spill_page, n, &ch->spill_wpos);
+        if (ret <= 0)
+            break;
+        done += ret;
+        WRITE_ONCE(ch->spill_len, ch->spill_len + ret);
+    }
+
+    atomic_long_add(done, &ch->spilled);
+    atomic_long_add(done, &ch->bytes_written);
+    return done ? done : ret;
+}
+
+/* asee_write_chunk() for the spill policy. Called under the read side of
+ * resize_sem.
+ */
+static ssize_t asee_spill_write(struct asee_channel *ch,
+                                const char __user *from, size_t len,
+                                bool from_user)
+{
+    ssize_t n = 0, ret;
+
+    mutex_lock(&ch->spill_lock);
+    asee_spill_refill(ch);
+    if (!ch->spill_len) {
+        n = asee_write_chunk(ch, from, len, from_user);
+        /* The policy may have changed since the caller looked at it */
+        if (n < 0 || n == len || ch->policy != ASEE_POLICY_SPILL)
+            goto out;
+    }
+
+    /* The ring is full, or data is waiting in the file before ours */
+    ret = asee_spill_append(ch, from + n, len - n, from_user);
+    if (ret < 0 && !n)
+        n = ret;
+    else if (ret > 0)
+        n += ret;
+out:
+    mutex_unlock(&ch->spill_lock);
+    return n;
+}
+
+/* Readers call this before they look at the ring */
+static void asee_spill_refill_reader(struct asee_channel *ch)
+{
+    if (!READ_ONCE(ch->spill_len))
+        return;
+    percpu_down_read(&ch->resize_sem);
+    mutex_lock(&ch->spill_lock);
+    asee_spill_refill(ch);
+    mutex_unlock(&ch->spill_lock);
+    percpu_up_read(&ch->resize_sem);
+    /* Room in the file for the writers waiting for it, and data in the
+     * ring for the other readers
+     */
+    wake_up_interruptible(&ch->write_waitq);
+    asee_wake_readers(ch);
+}
+
+/*
+ * Move up to len bytes (at most ASEE_MAX_CHUNK) to user space (or to kernel
+ * space if to_user is false). Returns the number of bytes read, 0 if
+ * another reader took the data first, or an error. Called under the read
+ * side of resize_sem.
+ *
+ * User bytes go through a bounce buffer, and are copied to user space once
+ * the reservation is committed, with page faults allowed, for the same
+ * reason as in asee_write_chunk().
+ */
+static ssize_t asee_read_chunk(struct asee_channel *ch, char __user *to,
+                               size_t len, bool to_user)
+{
+    const struct asee_sync_ops *sync = &asee_sync_backends[ch->sync];
+    char *dst = (__force char *)to;
+    unsigned long pos, left = 0;
+    char *bounce = NULL;
+    unsigned int n;
+
+    len = min_t(size_t, len, ASEE_MAX_CHUNK);
+    if (to_user) {
+        len -= fault_in_writeable(to, len);
+        if (!len)
+            return -EFAULT;
+        bounce = kvmalloc(len, GFP_KERNEL);
+        if (!bounce)
+            return -ENOMEM;
+        dst = bounce;
+    }
+
+    sync->lock(ch);
+    n = asee_cons_reserve(ch, len, &pos);
+    if (n) {
+        memcpy(dst, asee_ring_ptr(ch, pos), n);
+        asee_cons_commit(ch, pos, n);
+    }
+    sync->unlock(ch);
+
+    if (n && to_user)
+        left = copy_to_user(to, bounce, n);
+    kvfree(bounce);
+
+    if (left) {
+        /* The buffer was unmapped since it was faulted in: consumed but
+         * not delivered
+         */
+        asee_account_drop(ch, left);
+        if (left == n)
+            return -EFAULT;
+        n -= left;
+    }
+    atomic_long_add(n, &ch->bytes_read);
+    atomic_long_inc(&ch->reads);
+    return n;
+}
+
+/*
+ * Elastic channels. Transfers are done under elastic_lock with the usual
+ * uaccess (a fault may sleep), the positions are moved as for the ring so
+ * that the waits and wake-ups work the same.
+ */
+
+/* Take up to len of the oldest bytes of q, copied to to unless it is NULL
+ * (to kernel memory if to_user is false), and free the chunks that are left
+ * empty. Called with the lock of q held.
+ */
+static size_t asee_chunkq_take(struct asee_channel *ch, struct asee_chunkq *q,
+                               char __user *to, size_t len, bool to_user,
+                               int *error)
+{
+    struct asee_chunk *c;
+    size_t done = 0;
+    unsigned int n;
+
+    while (done < len) {
+        c = list_first_entry_or_null(&q->chunks, struct asee_chunk, list);
+        if (!c)
+            break;
+        n = min_t(size_t, len - done, c->tail - c->head);
+        if (to && !to_user) {
+            memcpy((__force char *)to + done, c->data + c->head, n);
+        } else if (to && copy_to_user(to + done, c->data + c->head, n)) {
+            *error = -EFAULT;
+            break;
+        }
+        c->head += n;
+        done += n;
+        if (c->head == c->tail) {
+            list_del(&c->list);
+            kmem_cache_free(asee_chunk_cache, c);
+            WRITE_ONCE(q->nr_chunks, q->nr_chunks - 1);
+            atomic_long_inc(&ch->chunk_shrinks);
+        }
+    }
+
+    WRITE_ONCE(q->len, q->len - done);
+    return done;
+}
+
+/* Append len bytes to q, adding chunks as needed. Called with the lock of
+ * q held.
+ */
+static size_t asee_chunkq_put(struct asee_channel *ch, struct asee_chunkq *q,
+                              const char __user *from, size_t len,
+                              bool from_user, int *error)
+{
+    struct asee_chunk *c;
+    size_t done = 0;
+    unsigned int n;
+
+    while (done < len) {
+        c = list_last_entry_or_null(&q->chunks, struct asee_chunk, list);
+        if (!c || c->tail == ASEE_CHUNK_DATA) {
+            c = kmem_cache_alloc(asee_chunk_cache, GFP_KERNEL_ACCOUNT);
+            if (!c) {
+                *error = -ENOMEM;
+                break;
+            }
+            c->head = c->tail = 0;
+            list_add_tail(&c->list, &q->chunks);
+            WRITE_ONCE(q->nr_chunks, q->nr_chunks + 1);
+            if (q->nr_chunks > q->chunks_peak)
+                WRITE_ONCE(q->chunks_peak, q->nr_chunks);
+            atomic_long_inc(&ch->chunk_grows);
+        }
+
+        n = min_t(size_t, len - done, ASEE_CHUNK_DATA - c->tail);
+        if (!from_user) {
+            memcpy(c->data + c->tail, (__force const char *)from + done, n);
+        } else if (copy_from_user(c->data + c->tail, from + done, n)) {
+            *error = -EFAULT;
+            break;
+        }
+        c->tail += n;
+        done += n;
+    }
+
+    WRITE_ONCE(q->len, q->len + done);
+    return done;
+}
+
+/* The chunk queue of an elastic channel, with its positions. Called with
+ * elastic_lock held.
+ */
+static size_t asee_elastic_take(struct asee_channel *ch, char __user *to,
+                                size_t len, bool to_user, int *error)
+{
+    size_t done = asee_chunkq_take(ch, &ch->chunkq, to, len, to_user, error);
+
+    ch->cons_head += done;
+    smp_store_release(&ch->cons_tail, ch->cons_head);
+    return done;
+}
+
+static size_t asee_elastic_put(struct asee_channel *ch,
+                               const char __user *from, size_t len,
+                               bool from_user, int *error)
+{
+    size_t done = asee_chunkq_put(ch, &ch->chunkq, from, len, from_user, error);
+
+    ch->prod_head += done;
+    smp_store_release(&ch->prod_tail, ch->prod_head);
+    return done;
+}
+
+/* asee_write_chunk() for elastic channels */
+static ssize_t asee_elastic_write(struct asee_channel *ch,
+                                  const char __user *from, size_t len,
+                                  bool from_user)
+{
+    enum asee_policy policy = READ_ONCE(ch->policy);
+    unsigned long stored, space;
+    size_t consumed = 0, done;
+    int error = 0;
+
+    mutex_lock(&ch->elastic_lock);
+    if (policy == ASEE_POLICY_OVERWRITE_OLDEST && len > ch->asee_buf_size) {
+        consumed = len - ch->asee_buf_size;
+        asee_account_drop(ch, consumed);
+        from += consumed;
+        len = ch->asee_buf_size;
+    }
+
+    stored = ch->prod_tail - ch->cons_tail;
+    space = stored < ch->asee_buf_size ? ch->asee_buf_size - stored : 0;
+    if (len > space) {
+        if (policy == ASEE_POLICY_OVERWRITE_OLDEST) {
+            asee_account_drop(ch, asee_elastic_take(ch, NULL, len - space,
+                                                    false, &error));
+        } else if (policy == ASEE_POLICY_DROP_NEWEST) {
+            asee_account_drop(ch, len - space);
+            consumed += len - space;
+            len = space;
+        } else {
+            len = space;
+        }
+    }
+
+    done = asee_elastic_put(ch, from, len, from_user, &error);
+    mutex_unlock(&ch->elastic_lock);
+
+    if (done)
+        atomic_long_add(done, &ch->bytes_written);
+    if (!done && error)
+        return consumed ? consumed : error;
+    return consumed + done;
+}
+
+/* asee_read_chunk() for elastic channels */
+static ssize_t asee_elastic_read(struct asee_channel *ch, char __user *to,
+                                 size_t len, bool to_user)
+{
+    size_t done;
+    int error = 0;
+
+    mutex_lock(&ch->elastic_lock);
+    done = asee_elastic_take(ch, to, len, to_user, &error);
+    mutex_unlock(&ch->elastic_lock);
+
+    if (!done)
+        return error;
+    atomic_long_add(done, &ch->bytes_read);
+    atomic_long_inc(&ch->reads);
+    return done;
+}
+
+static int asee_wait(struct asee_channel *ch, wait_queue_head_t *wq,
+                     bool (*ready)(struct asee_channel *, unsigned int),
+                     unsigned int want, atomic_long_t *wakeups, u64 gap_ns,
+                     ktime_t *deadline, bool nonblock);
+
+/*
+ * Priority lanes, see asee_lane.
+ */
+static unsigned long asee_lane_avail(struct asee_channel *ch, int l)
+{
+    if (l)
+        return READ_ONCE(ch->lanes[l].q.len);
+    return smp_load_acquire(&ch->prod_tail) - READ_ONCE(ch->cons_head);
+}
+
+/* Is there room in lane want? (the lane is passed as want, for asee_wait) */
+static bool asee_lane_room(struct asee_channel *ch, unsigned int want)
+{
+    return READ_ONCE(ch->lanes[want].q.len) < READ_ONCE(ch->lanes[want].max);
+}
+
+/* The lane a reader takes from, and in fair mode, how much it may take */
+static int asee_pick_lane(struct asee_channel *ch, size_t *quota)
+{
+    struct asee_lane *lane;
+    int i, l;
+
+    *quota = SIZE_MAX;
+    if (!atomic_long_read(&ch->lanes_len))
+        return 0;
+    if (!READ_ONCE(ch->lanes_fair)) {
+        for (l = ASEE_NR_LANES - 1; l > 0; l--)
+            if (asee_lane_avail(ch, l))
+                return l;
+        return 0;
+    }
+
+    spin_lock(&ch->lane_lock);
+    for (i = 0; i < 2 * ASEE_NR_LANES; i++) {
+        l = ch->lane_rr;
+        lane = &ch->lanes[l];
+        if (!asee_lane_avail(ch, l))
+            lane->deficit = 0;
+        else if (lane->deficit > 0)
+            break;
+        /* Next lane, with its quantum for this round */
+        ch->lane_rr = (l + 1) % ASEE_NR_LANES;
+        ch->lanes[ch->lane_rr].deficit +=
+            (long)READ_ONCE(ch->lanes[ch->lane_rr].weight) * ASEE_LANE_QUANTUM;
+    }
+    if (i == 2 * ASEE_NR_LANES)
+        l = 0;
+    else
+        *quota = lane->deficit;
+    spin_unlock(&ch->lane_lock);
+    return l;
+}
+
+/* Charge n bytes read from lane l to its deficit */
+static void asee_lane_charge(struct asee_channel *ch, int l, size_t n)
+{
+    if (!READ_ONCE(ch->lanes_fair))
+        return;
+    spin_lock(&ch->lane_lock);
+    ch->lanes[l].deficit -= n;
+    spin_unlock(&ch->lane_lock);
+}
+
+static ssize_t asee_lane_read(struct asee_channel *ch, int l,
+                              char __user *to, size_t len, bool to_user)
+{
+    struct asee_lane *lane = &ch->lanes[l];
+    size_t done;
+    int error = 0;
+
+    mutex_lock(&lane->lock);
+    done = asee_chunkq_take(ch, &lane->q, to, len, to_user, &error);
+    mutex_unlock(&lane->lock);
+
+    if (!done)
+        return error;
+    atomic_long_sub(done, &ch->lanes_len);
+    atomic_long_add(done, &ch->bytes_read);
+    atomic_long_inc(&ch->reads);
+    /* Room for the writers of the lane */
+    wake_up_interruptible(&ch->write_waitq);
+    return done;
+}
+
+/*
+ * Store len bytes in lane l. When the lane is full, the writer waits with
+ * the block and spill policies, the rest of the write is dropped with the
+ * others.
+ */
+static ssize_t asee_lane_write(struct asee_channel *ch, int l,
+                               const char __user *from, size_t len,
+                               bool from_user, bool nonblock)
+{
+    struct asee_lane *lane = &ch->lanes[l];
+    enum asee_policy policy;
+    size_t done = 0, room, n;
+    int error = 0;
+
+    while (done < len) {
+        mutex_lock(&lane->lock);
+        room = lane->q.len < lane->max ? lane->max - lane->q.len : 0;
+        n = asee_chunkq_put(ch, &lane->q, from + done,
+                            min(len - done, room), from_user, &error);
+        mutex_unlock(&lane->lock);
+
+        if (n) {
+            done += n;
+            atomic_long_add(n, &ch->lanes_len);
+            atomic_long_add(n, &ch->bytes_written);
+            wake_up_interruptible(&ch->read_waitq);
+        }
+        if (error || done == len || room)
+            break;
+
+        policy = READ_ONCE(ch->policy);
+        if (policy != ASEE_POLICY_BLOCK && policy != ASEE_POLICY_SPILL) {
+            atomic_long_add(len - done, &lane->dropped);
+            asee_account_drop(ch, len - done);
+            done = len;
+            break;
+        }
+        error = asee_wait(ch, &ch->write_waitq, asee_lane_room, l,
+                          &ch->write_wakeups, READ_ONCE(ch->read_gap_ns),
+                          NULL, nonblock);
+    }
+    return done ? done : error;
+}
+
+/*
+ * Keyed records and consumer groups, see asee_shard.
+ */
+
+/* Deal the shards to the members in turn, by slot. Called with group_sem
+ * held for writing.
+ */
+static void asee_group_rebalance(struct asee_channel *ch)
+{
+    int nr = bitmap_weight(&ch->members, ASEE_MAX_MEMBERS);
+    int s, slot = -1;
+
+    for (s = 0; s < ASEE_MAX_SHARDS; s++) {
+        if (nr && s < ch->nr_shards) {
+            slot = find_next_bit(&ch->members, ASEE_MAX_MEMBERS, slot + 1);
+            if (slot >= ASEE_MAX_MEMBERS)
+                slot = find_first_bit(&ch->members, ASEE_MAX_MEMBERS);
+            WRITE_ONCE(ch->shards[s].owner, slot);
+        } else {
+            WRITE_ONCE(ch->shards[s].owner, -1);
+        }
+    }
+    atomic_long_inc(&ch->rebalances);
+    /* The new owners may have records waiting for them */
+    wake_up_interruptible_all(&ch->read_waitq);
+}
+
+static int asee_group_join(struct asee_file *af)
+{
+    struct asee_channel *ch = af->ch;
+    int slot, error = 0;
+
+    down_write(&ch->group_sem);
+    if (af->member >= 0) {
+        error = -EALREADY;
+    } else {
+        slot = find_first_zero_bit(&ch->members, ASEE_MAX_MEMBERS);
+        if (slot >= ASEE_MAX_MEMBERS) {
+            error = -EUSERS;
+        } else {
+            __set_bit(slot, &ch->members);
+            WRITE_ONCE(af->member, slot);
+            asee_group_rebalance(ch);
+        }
+    }
+    up_write(&ch->group_sem);
+    return error;
+}
+
+static int asee_group_leave(struct asee_file *af)
+{
+    struct asee_channel *ch = af->ch;
+    int error = 0;
+
+    down_write(&ch->group_sem);
+    if (af->member < 0) {
+        error = -EINVAL;
+    } else {
+        __clear_bit(af->member, &ch->members);
+        WRITE_ONCE(af->member, -1);
+        asee_group_rebalance(ch);
+    }
+    up_write(&ch->group_sem);
+    return error;
+}
+
+/* Does member slot own a shard with records? */
+static bool asee_member_readable(struct asee_channel *ch, unsigned int slot)
+{
+    int s;
+
+    for (s = 0; s < READ_ONCE(ch->nr_shards); s++)
+        if (READ_ONCE(ch->shards[s].owner) == slot &&
+            READ_ONCE(ch->shards[s].q.len))
+            return true;
+    return false;
+}
+
+/* Is there room in shard s? (the shard is passed as want, for asee_wait) */
+static bool asee_shard_room(struct asee_channel *ch, unsigned int s)
+{
+    return READ_ONCE(ch->shards[s].q.len) < READ_ONCE(ch->shard_max);
+}
+
+/* Copy the first n bytes of q to to, without taking them */
+static void asee_chunkq_peek(struct asee_chunkq *q, void *to, size_t n)
+{
+    struct asee_chunk *c;
+    size_t done = 0, k;
+
+    list_for_each_entry(c, &q->chunks, list) {
+        k = min_t(size_t, n - done, c->tail - c->head);
+        memcpy(to + done, c->data + c->head, k);
+        done += k;
+        if (done == n)
+            break;
+    }
+}
+
+/* Take back the last n bytes put in q */
+static void asee_chunkq_trim(struct asee_channel *ch, struct asee_chunkq *q,
+                             size_t n)
+{
+    struct asee_chunk *c;
+    unsigned int k;
+
+    WRITE_ONCE(q->len, q->len - n);
+    while (n) {
+        c = list_last_entry(&q->chunks, struct asee_chunk, list);
+        k = min_t(size_t, n, c->tail - c->head);
+        c->tail -= k;
+        n -= k;
+        if (c->head == c->tail) {
+            list_del(&c->list);
+            kmem_cache_free(asee_chunk_cache, c);
+            WRITE_ONCE(q->nr_chunks, q->nr_chunks - 1);
+            atomic_long_inc(&ch->chunk_shrinks);
+        }
+    }
+}
+
+/*
+ * Queue a record of len bytes under key. The record is copied in first, so
+ * that it goes in whole or not at all. When its shard is full, the writer
+ * waits with the block and spill policies, the record is dropped with the
+ * others.
+ */
+static ssize_t asee_keyed_write(struct asee_channel *ch,
+                                const char __user *from, size_t len, u64 key,
+                                bool nonblock)
+{
+    struct asee_shard *shard;
+    enum asee_policy policy;
+    u32 hdr = len;
+    void *rec;
+    size_t n;
+    int error = 0, s;
+    bool done = false;
+
+    if (!len || len > ASEE_MAX_CHUNK)
+        return -EINVAL;
+    rec = memdup_user(from, len);
+    if (IS_ERR(rec))
+        return PTR_ERR(rec);
+
+    while (!done && !error) {
+        down_read(&ch->group_sem);
+        s = hash_64(key, 32) % ch->nr_shards;
+        shard = &ch->shards[s];
+        mutex_lock(&shard->lock);
+        /* An empty shard takes any record */
+        if (!shard->q.len || shard->q.len + sizeof(hdr) + len <=
+                             READ_ONCE(ch->shard_max)) {
+            n = asee_chunkq_put(ch, &shard->q, (__force const char __user *)&hdr,
+                                sizeof(hdr), false, &error);
+            n += asee_chunkq_put(ch, &shard->q, (__force const char __user *)rec,
+                                 error ? 0 : len, false, &error);
+            if (error)
+                asee_chunkq_trim(ch, &shard->q, n);
+            else
+                WRITE_ONCE(shard->records, shard->records + 1);
+            done = true;
+        }
+        mutex_unlock(&shard->lock);
+        up_read(&ch->group_sem);
+        if (done)
+            break;
+
+        policy = READ_ONCE(ch->policy);
+        if (policy != ASEE_POLICY_BLOCK && policy != ASEE_POLICY_SPILL) {
+            asee_account_drop(ch, len);
+            kfree(rec);
+            return len;
+        }
+        error = asee_wait(ch, &ch->write_waitq, asee_shard_room, s,
+                          &ch->write_wakeups, READ_ONCE(ch->read_gap_ns),
+                          NULL, nonblock);
+    }
+    kfree(rec);
+    if (error)
+        return error;
+
+    atomic_long_add(len, &ch->bytes_written);
+    /* Goes to the owner of the shard, the only reader it can wake */
+    wake_up_interruptible(&ch->read_waitq);
+    return len;
+}
+
+/* Take the first record of shard, if it fits in len bytes */
+static ssize_t asee_shard_take(struct asee_channel *ch,
+                               struct asee_shard *shard, char __user *to,
+                               size_t len, bool to_user)
+{
+    int error = 0;
+    size_t n;
+    u32 hdr;
+
+    if (!shard->q.len)
+        return 0;
+    asee_chunkq_peek(&shard->q, &hdr, sizeof(hdr));
+    if (hdr > len)
+        return -EMSGSIZE;
+
+    asee_chunkq_take(ch, &shard->q, NULL, sizeof(hdr), false, &error);
+    n = asee_chunkq_take(ch, &shard->q, to, hdr, to_user, &error);
+    WRITE_ONCE(shard->records, shard->records - 1);
+    if (error) {
+        /* The rest of the record goes too, to keep the shard framed */
+        asee_chunkq_take(ch, &shard->q, NULL, hdr - n, false, &error);
+        asee_account_drop(ch, hdr);
+        return error;
+    }
+    return hdr;
+}
+
+/*
+ * read() by a member of the consumer group: one record from the shards it
+ * owns, taken in turn. A record larger than the read fails with EMSGSIZE
+ * and stays in place.
+ */
+static ssize_t asee_group_read(struct asee_file *af, char __user *to,
+                               size_t len, bool to_user, bool nonblock)
+{
+    struct asee_channel *ch = af->ch;
+    struct asee_shard *shard;
+    ssize_t n = 0;
+    int i, s, ret;
+
+    while (!n) {
+        ret = asee_wait(ch, &ch->read_waitq, asee_member_readable,
+                        READ_ONCE(af->member), &ch->read_wakeups,
+                        READ_ONCE(ch->write_gap_ns), NULL, nonblock);
+        if (ret)
+            return ret;
+
+        down_read(&ch->group_sem);
+        for (i = 0; i < ch->nr_shards && !n; i++) {
+            s = (af->shard_rr + i) % ch->nr_shards;
+            shard = &ch->shards[s];
+            /* The owner only changes under the write side */
+            if (shard->owner != af->member || !READ_ONCE(shard->q.len))
+                continue;
+            mutex_lock(&shard->lock);
+            n = asee_shard_take(ch, shard, to, len, to_user);
+            mutex_unlock(&shard->lock);
+            af->shard_rr = s + 1;
+        }
+        up_read(&ch->group_sem);
+    }
+
+    if (n > 0) {
+        atomic_long_add(n, &ch->bytes_read);
+        atomic_long_inc(&ch->reads);
+        /* Room in the shard: the wake-up goes to the first writer, by
+         * priority, that waits for it (see asee_wait())
+         */
+        wake_up_interruptible(&ch->write_waitq);
+    }
+    return n;
+}
+
+/*
+ * How long to busy-poll, given the average time gap_ns between two events
+ * of the other side: spinning only pays off when the next event is likely
+ * to come within the budget. Without history yet, spin the full budget.
+ */
+static u64 asee_spin_budget_ns(struct asee_channel *ch, u64 gap_ns)
+{
+    u64 budget = (u64)READ_ONCE(ch->busy_poll_us) * NSEC_PER_USEC;
+
+    if (!gap_ns)
+        return budget;
+    if (gap_ns > budget)
+        return 0;
+    return min(budget, 2 * gap_ns);
+}
+
+/* Spin until ready(ch, want) or the budget is spent */
+static bool asee_spin(struct asee_channel *ch,
+                      bool (*ready)(struct asee_channel *, unsigned int),
+                      unsigned int want, u64 budget_ns)
+{
+    u64 start = ktime_get_ns();
+    bool hit = false;
+
+    do {
+        if (ready(ch, want)) {
+            hit = true;
+            break;
+        }
+        if (need_resched() || signal_pending(current))
+            break;
+        cpu_relax();
+    } while (ktime_get_ns() - start < budget_ns);
+
+    atomic64_add(ktime_get_ns() - start, &ch->spin_ns);
+    atomic_long_inc(hit ? &ch->spin_hits : &ch->spin_misses);
+    return hit;
+}
+
+/*
+ * Record the time elapsed since the previous event in an average. The
+ * update races with other tasks doing the same, which at worst loses a
+ * sample: good enough for a heuristic.
+ */
+static void asee_update_gap(u64 *last_ns, u64 *gap_ns)
+{
+    u64 now = ktime_get_ns();
+    u64 last = READ_ONCE(*last_ns);
+    u64 gap = READ_ONCE(*gap_ns);
+
+    if (last)
+        WRITE_ONCE(*gap_ns, gap ? (gap * 7 + (now - last)) / 8 : now - last);
+    WRITE_ONCE(*last_ns, now);
+}
+
+/* Add a sample. The maximum is racy like asee_update_gap(). */
+static void asee_lat_add(struct asee_lat *lat, u64 ns)
+{
+    atomic_long_inc(&lat->count);
+    atomic64_add(ns, &lat->sum_ns);
+    if (ns > READ_ONCE(lat->max_ns))
+        WRITE_ONCE(lat->max_ns, ns);
+}
+
+struct asee_waiter {
+    struct wait_queue_entry wq;
+    struct asee_channel *ch;
+    bool (*ready)(struct asee_channel *, unsigned int);
+    unsigned int want;
+    int abort_gen;
+    int prio;     /* of the task when it queued, lower first */
+};
+
+/*
+ * Only wake a waiter that can go on: a reader waiting for read_min bytes is
+ * not woken for each byte. A waiter that is skipped does not count in the
+ * number of tasks to wake, the wake-up goes to the next one in line.
+ */
+static int asee_wake_function(struct wait_queue_entry *wq, unsigned int mode,
+                              int flags, void *key)
+{
+    struct asee_waiter *w = container_of(wq, struct asee_waiter, wq);
+
+    if (!w->ready(w->ch, w->want) &&
+        atomic_read(&w->ch->abort_gen) == w->abort_gen)
+        return 0;
+    return default_wake_function(wq, mode, flags, key);
+}
+
+/* Scheduling class of current, for wait_lat */
+static enum asee_wclass asee_wclass(void)
+{
+    switch (current->policy) {
+    case SCHED_DEADLINE:
+        return ASEE_WCLASS_DEADLINE;
+    case SCHED_FIFO:
+    case SCHED_RR:
+        return ASEE_WCLASS_RT;
+    case SCHED_BATCH:
+        return ASEE_WCLASS_BATCH;
+    case SCHED_IDLE:
+        return ASEE_WCLASS_IDLE;
+    default:
+        return ASEE_WCLASS_NORMAL;
+    }
+}
+
+/*
+ * Queue w as an exclusive waiter after the waiters of the same or a higher
+ * priority, like a plist: deadline tasks first, then real-time ones, then
+ * the others by nice level. The priority is the one of the task (boosts
+ * included) when it queues. The non-exclusive entries of poll() stay at
+ * the head, where add_wait_queue() puts them.
+ */
+static void asee_add_waiter(wait_queue_head_t *wq, struct asee_waiter *w)
+{
+    struct wait_queue_entry *pos;
+    unsigned long flags;
+
+    w->wq.flags |= WQ_FLAG_EXCLUSIVE;
+    spin_lock_irqsave(&wq->lock, flags);
+    list_for_each_entry(pos, &wq->head, entry) {
+        if (pos->func == asee_wake_function &&
+            container_of(pos, struct asee_waiter, wq)->prio > w->prio) {
+            list_add_tail(&w->wq.entry, &pos->entry);
+            goto out;
+        }
+    }
+    list_add_tail(&w->wq.entry, &wq->head);
+out:
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/*
+ * Wait until ready(ch, want) holds. Returns 0, -ETIME once the absolute
+ * deadline has passed (if deadline is not NULL), -ECONNABORTED if the
+ * waits of the channel were aborted meanwhile, or another error.
+ *
+ * The waiter is queued once, by priority (see asee_add_waiter()), as an
+ * exclusive waiter, and stays at its place in the queue until it leaves: a
+ * task that finds nothing to do after a wake-up goes back to sleep without
+ * losing its turn. The entry is not removed by the wake-up itself, so
+ * wake_up_nr() skips tasks that are already running and always hands the
+ * wake-ups to sleeping ones.
+ *
+ * Before sleeping, the task busy-polls for a while (see busy_poll_us);
+ * gap_ns is the average time between two events of the other side.
+ */
+static int asee_wait(struct asee_channel *ch, wait_queue_head_t *wq,
+                     bool (*ready)(struct asee_channel *, unsigned int),
+                     unsigned int want, atomic_long_t *wakeups, u64 gap_ns,
+                     ktime_t *deadline, bool nonblock)
+{
+    struct asee_waiter w = {
+        .ch = ch,
+        .ready = ready,
+        .want = want,
+    };
+    bool writer = wq != &ch->read_waitq;
+    atomic_t *waiters = writer ? &ch->write_waiters : &ch->read_waiters;
+    int gen = atomic_read(&ch->abort_gen);
+    u64 budget, start, slept;
+    int ret = 0;
+
+    if (ready(ch, want))
+        return 0;
+    if (nonblock)
+        return -EAGAIN;
+
+    budget = asee_spin_budget_ns(ch, gap_ns);
+    if (budget && asee_spin(ch, ready, want, budget))
+        return 0;
+
+    init_waitqueue_func_entry(&w.wq, asee_wake_function);
+    w.wq.private = current;
+    w.abort_gen = gen;
+    w.prio = current->prio;
+
+    start = ktime_get_ns();
+    atomic_inc(waiters);
+    asee_add_waiter(wq, &w);
+    for (;;) {
+        /* Pairs with the barrier in wq_has_sleeper() on the waker side:
+         * either we see the new state, or the waker sees us queued.
+         */
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (atomic_read(&ch->abort_gen) != gen) {
+            ret = -ECONNABORTED;
+            break;
+        }
+        if (ready(ch, want))
+            break;
+        if (signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        if (!deadline) {
+            schedule();
+        } else if (!schedule_hrtimeout_range(deadline, 0, HRTIMER_MODE_ABS)) {
+            ret = ready(ch, want) ? 0 : -ETIME;
+            break;
+        }
+        atomic_long_inc(wakeups);
+    }
+    __set_current_state(TASK_RUNNING);
+    remove_wait_queue(wq, &w.wq);
+    atomic_dec(waiters);
+    slept = ktime_get_ns() - start;
+    atomic64_add(slept, &ch->sleep_ns);
+    asee_lat_add(&ch->wait_lat[writer][asee_wclass()], slept);
+
+    /* We may have been handed a wake-up that we will not use: pass it on
+     * to the next waiter in line.
+     */
+    if (ret && ready(ch, 1))
+        wake_up_interruptible(wq);
+    return ret;
+}
+
+/* A reader got past the mark left by the bottom half: one latency sample */
+static void asee_irq_read_mark(struct asee_channel *ch)
+{
+    u64 mark = smp_load_acquire(&ch->irq_mark_ns);
+
+    if (!mark || READ_ONCE(ch->cons_tail) - READ_ONCE(ch->irq_mark_pos) >
+                 ULONG_MAX / 2)
+        return;
+    if (cmpxchg(&ch->irq_mark_ns, mark, 0) == mark)
+        asee_lat_add(&ch->irq_read_lat, ktime_get_ns() - mark);
+}
+
+/* Exponential moving average (weight 1/8) of the transfer sizes. Racy like
+ * asee_update_gap().
+ */
+static void asee_update_avg(unsigned int *avg, size_t n)
+{
+    WRITE_ONCE(*avg, (READ_ONCE(*avg) * 7 +
+                      min_t(size_t, n, UINT_MAX / 8)) / 8);
+}
+
+/*
+ * Wake as many readers as the stored data can serve, given how much a
+ * reader usually takes. With the ring empty and data in the spill file,
+ * one reader is woken to move it back.
+ */
+static void asee_wake_readers(struct asee_channel *ch)
+{
+    unsigned long avail;
+
+    if (!wq_has_sleeper(&ch->read_waitq))
+        return;
+    avail = smp_load_acquire(&ch->prod_tail) - READ_ONCE(ch->cons_head);
+    if (avail)
+        wake_up_interruptible_nr(&ch->read_waitq,
+                                 DIV_ROUND_UP(avail,
+                                              max(READ_ONCE(ch->read_avg), 1u)));
+    else if (READ_ONCE(ch->spill_len))
+        wake_up_interruptible(&ch->read_waitq);
+}
+
+/* Same for writers, with the free space */
+static void asee_wake_writers(struct asee_channel *ch)
+{
+    unsigned long space;
+
+    if (!wq_has_sleeper(&ch->write_waitq))
+        return;
+    space = READ_ONCE(ch->asee_buf_size) -
+            (READ_ONCE(ch->prod_head) - smp_load_acquire(&ch->cons_tail));
+    if (space && space <= READ_ONCE(ch->asee_buf_size))
+        wake_up_interruptible_nr(&ch->write_waitq,
+                                 DIV_ROUND_UP(space,
+                                              max(READ_ONCE(ch->write_avg), 1u)));
+}
+
+static int asee_wc_flush(struct asee_file *af, bool nonblock);
+static enum hrtimer_restart asee_wc_timer_fn(struct hrtimer *timer);
+static void asee_wc_work_fn(struct work_struct *work);
+
+/* Called when a process tries to open the device file, like
+ * "sudo cat /dev/chardev"
+ */
+static int device_open(struct inode *inode, struct file *file)
+{
+    struct asee_file *af;
+    unsigned int minor = iminor(inode);
+
+    if (minor >= nr_channels)
+        return -ENODEV;
+
+    //if (atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
+        //return -EBUSY;
+
+    af = kzalloc(sizeof(*af), GFP_KERNEL);
+    if (!af)
+        return -ENOMEM;
+    af->ch = asee_chans[minor];
+    af->lost_seen = atomic_long_read(&af->ch->dropped);
+    af->read_min = READ_ONCE(af->ch->read_min);
+    af->read_timeout_us = READ_ONCE(af->ch->read_timeout_us);
+    af->member = -1;
+    mutex_init(&af->wc_lock);
+    hrtimer_init(&af->wc_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    af->wc_timer.function = asee_wc_timer_fn;
+    INIT_WORK(&af->wc_work, asee_wc_work_fn);
+    file->private_data = af;
+
+    try_module_get(THIS_MODULE);
+
+    return SUCCESS;
+}
+
+/* Called when a process closes the device file. */
+static int device_release(struct inode *inode, struct file *file)
+{
+    struct asee_file *af = file->private_data;
+
+    /* We're now ready for our next caller */
+    atomic_set(&already_open, CDEV_NOT_USED);
+
+    /* Stop the flush timer for good (the worker re-arms it only while
+     * wc_flush_us is set), then publish what the last flush() left, or
+     * account it as lost.
+     */
+    mutex_lock(&af->wc_lock);
+    af->wc_flush_us = 0;
+    mutex_unlock(&af->wc_lock);
+    hrtimer_cancel(&af->wc_timer);
+    cancel_work_sync(&af->wc_work);
+    if (af->wc_len && asee_wc_flush(af, true))
+        asee_account_drop(af->ch, af->wc_len);
+    /* Its shards go to the other members */
+    if (af->member >= 0)
+        asee_group_leave(af);
+    kfree(af->wc_buf);
+    kfree(af);
+
+    /* Decrement the usage count, or else once you opened the file, you will
+     * never get rid of the module.
+     */
+    module_put(THIS_MODULE);
+    return SUCCESS;
+}
+
+/*
+ * Once there is data, wait for the read thresholds of the file: until
+ * read_min bytes (at most length) are there, or read_timeout_us has passed
+ * since the first byte was seen. Returns 0 or -ERESTARTSYS.
+ */
+static int asee_wait_read_min(struct asee_file *af, size_t length)
+{
+    struct asee_channel *ch = af->ch;
+    unsigned int want = min_t(size_t, af->read_min, length);
+    ktime_t deadline = 0;
+    int ret;
+
+    if (want <= 1 || asee_read_ready(ch, want))
+        return 0;
+
+    if (af->read_timeout_us)
+        deadline = ktime_add_us(ktime_get(), af->read_timeout_us);
+    ret = asee_wait(ch, &ch->read_waitq, asee_read_ready, want,
+                    &ch->read_wakeups, READ_ONCE(ch->write_gap_ns),
+                    af->read_timeout_us ? &deadline : NULL, false);
+    return ret == -ETIME ? 0 : ret;
+}
+
+/*
+ * Read what is available of the channel, at most len bytes, to user space
+ * (or to kernel space if to_user is false), as read() does: block while the
+ * channel is empty, then wait for the read thresholds of the file.
+ */
+static ssize_t asee_file_read(struct asee_file *af, char __user *to,
+                              size_t len, bool to_user, bool nonblock)
+{
+    struct asee_channel *ch = af->ch;
+    size_t quota;
+    ssize_t n;
+    int ret, lane;
+
+    if (READ_ONCE(af->member) >= 0)
+        return asee_group_read(af, to, len, to_user, nonblock);
+    len = min_t(size_t, len, ASEE_MAX_CHUNK);
+
+    /* The refill is done on each pass, so that a reader woken for the
+     * spilled data moves it to the ring before it reads
+     */
+    for (;;) {
+        asee_spill_refill_reader(ch);
+        ret = asee_wait(ch, &ch->read_waitq, asee_read_ready, 1,
+                        &ch->read_wakeups, READ_ONCE(ch->write_gap_ns),
+                        NULL, nonblock);
+        if (!ret && !nonblock)
+            ret = asee_wait_read_min(af, len);
+        if (ret)
+            return ret;
+
+        lane = asee_pick_lane(ch, &quota);
+        if (lane) {
+            n = asee_lane_read(ch, lane, to, min(len, quota), to_user);
+        } else {
+            percpu_down_read(&ch->resize_sem);
+            if (ch->elastic)
+                n = asee_elastic_read(ch, to, min(len, quota), to_user);
+            else
+                n = asee_read_chunk(ch, to, min(len, quota), to_user);
+            percpu_up_read(&ch->resize_sem);
+        }
+        if (n)
+            break;
+
+        /* Another reader took the data first, and the wait sleeps again.
+         * Should the channel look ready with nothing to read, a pass
+         * without progress still gives way to signals and other tasks.
+         */
+        if (nonblock)
+            return -EAGAIN;
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+        cond_resched();
+    }
+
+    if (n > 0) {
+        asee_lane_charge(ch, lane, n);
+        asee_update_avg(&ch->read_avg, n);
+        asee_update_gap(&ch->last_read_ns, &ch->read_gap_ns);
+        if (READ_ONCE(ch->node_auto))
+            atomic_long_add(n, &ch->node_bytes[numa_node_id()]);
+        if (!lane)
+            asee_irq_read_mark(ch);
+    }
+
+    /* Space for the writers, and if we left data behind, the next
+     * readers in line can have it.
+     */
+    asee_wake_writers(ch);
+    asee_wake_readers(ch);
+
+    return n;
+}
+
+/* Called when a process reads the device, e.g. "cat /dev/asee_mod", see
+ * asee_file_read(). A read fills the first segment of to, user memory, or
+ * kernel memory for kernel_read().
+ */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    bool nonblock = (filp->f_flags & O_NONBLOCK) ||
+                    (iocb->ki_flags & IOCB_NOWAIT);
+    size_t len;
+    ssize_t n;
+
+    if (user_backed_iter(to)) {
+        len = min(iter_iov_len(to), iov_iter_count(to));
+        if (!len)
+            return 0;
+        n = asee_file_read(filp->private_data, iter_iov_addr(to), len, true,
+                           nonblock);
+    } else if (iov_iter_is_kvec(to)) {
+        len = min(to->kvec->iov_len - to->iov_offset, iov_iter_count(to));
+        if (!len)
+            return 0;
+        n = asee_file_read(filp->private_data,
+                           (__force char __user *)to->kvec->iov_base +
+                           to->iov_offset, len, false, nonblock);
+    } else {
+        return -EINVAL;
+    }
+
+    if (n > 0)
+        iov_iter_advance(to, n);
+    return n;
+}
+
+/*
+ * Store len bytes in the channel, blocking for space if the policy says so.
+ * Returns the number of bytes consumed from the source, or an error if
+ * nothing was.
+ */
+static ssize_t asee_write_all(struct asee_channel *ch, const char __user *buff,
+                              size_t len, bool from_user, bool nonblock)
+{
+    size_t done = 0;
+    ssize_t n;
+    int ret;
+
+    while (done < len) {
+        percpu_down_read(&ch->resize_sem);
+        if (ch->elastic) {
+            n = asee_elastic_write(ch, buff + done,
+                                   min_t(size_t, len - done, ASEE_MAX_CHUNK),
+                                   from_user);
+        } else if (!ch->circular_buffer) {
+            /* First write, or the ring was freed while idle */
+            percpu_up_read(&ch->resize_sem);
+            ret = asee_ring_populate(ch);
+            if (ret)
+                return done ? done : ret;
+            continue;
+        } else if (READ_ONCE(ch->policy) == ASEE_POLICY_SPILL) {
+            n = asee_spill_write(ch, buff + done,
+                                 min_t(size_t, len - done, ASEE_MAX_CHUNK),
+                                 from_user);
+        } else {
+            n = asee_write_chunk(ch, buff + done,
+                                 min_t(size_t, len - done, ASEE_MAX_CHUNK),
+                                 from_user);
+        }
+        percpu_up_read(&ch->resize_sem);
+        if (n < 0)
+            return done ? done : n;
+
+        if (n) {
+            done += n;
+            asee_update_avg(&ch->write_avg, n);
+            asee_update_gap(&ch->last_write_ns, &ch->write_gap_ns);
+            asee_wake_readers(ch);
+            continue;
+        }
+
+        /* Full, and the policy is to block */
+        ret = asee_wait(ch, &ch->write_waitq, asee_write_ready, 1,
+                        &ch->write_wakeups, READ_ONCE(ch->read_gap_ns),
+                        NULL, nonblock);
+        if (ret)
+            return done ? done : ret;
+    }
+
+    /* Pass on the space we did not use */
+    asee_wake_writers(ch);
+    return done;
+}
+
+/*
+ * IRQ-side producer (see asee_kernel.h): the bytes are staged on the CPU,
+ * under a raw spinlock with interrupts off, and moved to the channel by
+ * the irq_bh work, which also does the wake-ups: a handler never waits for
+ * a reader or another producer.
+ */
+int asee_irq_produce(struct asee_channel *ch, const void *data, size_t len)
+{
+    struct asee_irq_stage *stage;
+    unsigned long flags;
+    int ret = 0;
+
+    local_irq_save(flags);
+    stage = this_cpu_ptr(ch->irq_stage);
+    raw_spin_lock(&stage->lock);
+    if (len > ASEE_IRQ_STAGE - stage->len) {
+        ret = -ENOSPC;
+    } else {
+        if (!stage->len)
+            stage->first_ns = ktime_get_ns();
+        memcpy(stage->buf + stage->len, data, len);
+        stage->len += len;
+    }
+    raw_spin_unlock(&stage->lock);
+    local_irq_restore(flags);
+
+    if (ret) {
+        atomic_long_add(len, &ch->irq_dropped);
+        asee_account_drop(ch, len);
+    }
+    queue_work(system_highpri_wq, &ch->irq_bh);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(asee_irq_produce);
+
+/* Bottom half: publish the stages of all the CPUs */
+static void asee_irq_bh_fn(struct work_struct *work)
+{
+    struct asee_channel *ch = container_of(work, struct asee_channel, irq_bh);
+    struct asee_irq_stage *stage;
+    unsigned int len;
+    ssize_t n;
+    u64 first;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        stage = per_cpu_ptr(ch->irq_stage, cpu);
+        raw_spin_lock_irq(&stage->lock);
+        len = stage->len;
+        first = stage->first_ns;
+        memcpy(ch->irq_bounce, stage->buf, len);
+        stage->len = 0;
+        raw_spin_unlock_irq(&stage->lock);
+        if (!len)
+            continue;
+
+        /* Nothing waits for room here: a full channel drops the rest */
+        n = asee_write_all(ch, (__force const char __user *)ch->irq_bounce,
+                           len, false, true);
+        if (n < 0)
+            n = 0;
+        if (n < len) {
+            atomic_long_add(len - n, &ch->irq_dropped);
+            asee_account_drop(ch, len - n);
+        }
+        if (!n)
+            continue;
+        atomic_long_add(n, &ch->irq_bytes);
+        asee_lat_add(&ch->irq_bh_lat, ktime_get_ns() - first);
+        if (!READ_ONCE(ch->irq_mark_ns)) {
+            WRITE_ONCE(ch->irq_mark_pos, smp_load_acquire(&ch->prod_tail));
+            smp_store_release(&ch->irq_mark_ns, first);
+        }
+    }
+}
+
+/* The simulated interrupt of asee_irq, run in hard IRQ context */
+static void asee_irq_sim_fn(struct irq_work *work)
+{
+    struct asee_channel *ch = container_of(work, struct asee_channel, irq_sim);
+    int nr = atomic_xchg(&ch->irq_sim_nr, 0);
+    char rec[32];
+    int len;
+
+    while (nr--) {
+        len = scnprintf(rec, sizeof(rec), "irq %ld\n",
+                        atomic_long_inc_return(&ch->irq_seq));
+        asee_irq_produce(ch, rec, len);
+    }
+}
+
+/*
+ * Publish the staged bytes of the file. Returns 0, or an error with what
+ * could not be published left in wc_buf. Called with wc_lock held.
+ */
+static int asee_wc_flush(struct asee_file *af, bool nonblock)
+{
+    ssize_t n;
+
+    if (!af->wc_len)
+        return 0;
+
+    n = asee_write_all(af->ch, (__force const char __user *)af->wc_buf,
+                       af->wc_len, false, nonblock);
+    if (n < 0)
+        return n;
+    if (n < af->wc_len) {
+        memmove(af->wc_buf, af->wc_buf + n, af->wc_len - n);
+        af->wc_len -= n;
+        return -EAGAIN;
+    }
+    af->wc_len = 0;
+    hrtimer_try_to_cancel(&af->wc_timer);
+    return 0;
+}
+
+/* The flush deadline has passed: publish from process context */
+static enum hrtimer_restart asee_wc_timer_fn(struct hrtimer *timer)
+{
+    struct asee_file *af = container_of(timer, struct asee_file, wc_timer);
+
+    schedule_work(&af->wc_work);
+    return HRTIMER_NORESTART;
+}
+
+static void asee_wc_work_fn(struct work_struct *work)
+{
+    struct asee_file *af = container_of(work, struct asee_file, wc_work);
+
+    mutex_lock(&af->wc_lock);
+    /* The worker does not wait for space: when the ring is full, try again
+     * after another period.
+     */
+    if (asee_wc_flush(af, true) && af->wc_flush_us)
+        hrtimer_start(&af->wc_timer, us_to_ktime(af->wc_flush_us),
+                      HRTIMER_MODE_REL);
+    mutex_unlock(&af->wc_lock);
+}
+
+/* A write on a file with write combining. Called with wc_lock held. */
+static ssize_t asee_wc_write(struct asee_file *af, const char __user *buff,
+                             size_t len, bool from_user, bool nonblock)
+{
+    int ret;
+
+    if (af->wc_len + len > af->wc_size) {
+        ret = asee_wc_flush(af, nonblock);
+        if (ret)
+            return ret;
+    }
+
+    /* Large writes are not worth staging, they go straight to the ring,
+     * after what was staged before them.
+     */
+    if (len >= af->wc_size)
+        return asee_write_all(af->ch, buff, len, from_user, nonblock);
+
+    if (!from_user)
+        memcpy(af->wc_buf + af->wc_len, (__force const char *)buff, len);
+    else if (copy_from_user(af->wc_buf + af->wc_len, buff, len))
+        return -EFAULT;
+    if (!af->wc_len && af->wc_flush_us)
+        hrtimer_start(&af->wc_timer, us_to_ktime(af->wc_flush_us),
+                      HRTIMER_MODE_REL);
+    af->wc_len += len;
+
+    if (af->wc_len >= af->wc_size) {
+        /* The bytes are staged and accepted, whatever happens to the
+         * flush: a failed one is retried later.
+         */
+        asee_wc_flush(af, nonblock);
+    }
+    return len;
+}
+
+/* Enable (size > 0) or disable write combining on the file */
+static int asee_wc_setup(struct asee_file *af, unsigned int size,
+                         unsigned int flush_us)
+{
+    char *buf = NULL;
+    int ret;
+
+    if (size > ASEE_MAX_CHUNK)
+        return -EINVAL;
+    if (size) {
+        buf = kmalloc(size, GFP_KERNEL);
+        if (!buf)
+            return -ENOMEM;
+    }
+
+    if (mutex_lock_interruptible(&af->wc_lock)) {
+        kfree(buf);
+        return -ERESTARTSYS;
+    }
+    ret = asee_wc_flush(af, false);
+    if (ret) {
+        mutex_unlock(&af->wc_lock);
+        kfree(buf);
+        return ret;
+    }
+    kfree(af->wc_buf);
+    af->wc_buf = buf;
+    af->wc_flush_us = flush_us;
+    WRITE_ONCE(af->wc_size, size);
+    mutex_unlock(&af->wc_lock);
+    return 0;
+}
+
+/*
+ * Rate limits. The bucket of the writer is found (or made) under
+ * rate_lock, and checked against both limits: a write within them is
+ * charged, one over them waits for the buckets to drain, fails with
+ * EAGAIN, or is dropped, following rate_action.
+ */
+static u64 asee_rate_id(struct asee_channel *ch)
+{
+    u64 id = task_tgid_nr(current);
+
+#ifdef CONFIG_CGROUPS
+    if (READ_ONCE(ch->rate_scope) == ASEE_RATE_CGROUP) {
+        rcu_read_lock();
+        id = cgroup_id(task_dfl_cgroup(current));
+        rcu_read_unlock();
+    }
+#endif
+    return id;
+}
+
+static struct asee_bucket *asee_bucket_find(struct asee_channel *ch, u64 id)
+{
+    struct asee_bucket *b;
+
+    hash_for_each_possible(ch->buckets, b, node, id)
+        if (b->id == id)
+            return b;
+    return NULL;
+}
+
+/* The bucket of the writer, with rate_lock held, or NULL without memory */
+static struct asee_bucket *asee_bucket_get(struct asee_channel *ch)
+{
+    u64 id = asee_rate_id(ch);
+    struct asee_bucket *b, *new;
+
+    spin_lock(&ch->rate_lock);
+    b = asee_bucket_find(ch, id);
+    if (b)
+        return b;
+    spin_unlock(&ch->rate_lock);
+
+    new = kzalloc(sizeof(*new), GFP_KERNEL);
+    if (!new)
+        return NULL;
+    new->id = id;
+    get_task_comm(new->comm, current);
+
+    spin_lock(&ch->rate_lock);
+    b = asee_bucket_find(ch, id);
+    if (b) {
+        kfree(new);
+        return b;
+    }
+    if (ch->nr_buckets >= ASEE_BUCKETS_KEPT)
+        asee_rate_flush(ch, false);
+    hash_add(ch->buckets, &new->node, id);
+    ch->nr_buckets++;
+    return new;
+}
+
+/* How long the bucket kept as tat must drain before it takes more, 0 if
+ * it can take some now
+ */
+static u64 asee_bucket_wait(u64 tat, u64 now)
+{
+    return tat > now + NSEC_PER_SEC ? tat - now - NSEC_PER_SEC : 0;
+}
+
+/*
+ * Apply the rate limits to a write of len bytes. Returns 0 if it may go
+ * on, 1 if it is dropped, or an error.
+ */
+static int asee_rate_limit(struct asee_channel *ch, size_t len, bool nonblock)
+{
+    unsigned int rate_b = READ_ONCE(ch->rate_bytes);
+    unsigned int rate_r = READ_ONCE(ch->rate_records);
+    struct asee_bucket *b;
+    u64 now, wait, slept = 0;
+    ktime_t kt;
+
+    if (!rate_b && !rate_r)
+        return 0;
+
+    for (;;) {
+        /* Looked up again after a sleep: the scope may have changed */
+        b = asee_bucket_get(ch);
+        if (!b)
+            return -ENOMEM;
+        b->wait_ns += slept;
+        now = ktime_get_ns();
+        wait = max(rate_b ? asee_bucket_wait(b->tat_bytes, now) : 0,
+                   rate_r ? asee_bucket_wait(b->tat_records, now) : 0);
+        if (!wait)
+            break;
+
+        if (!slept)
+            b->throttled++;
+        if (READ_ONCE(ch->rate_action) == ASEE_RATE_DROP) {
+            b->dropped += len;
+            spin_unlock(&ch->rate_lock);
+            asee_account_drop(ch, len);
+            return 1;
+        }
+        if (READ_ONCE(ch->rate_action) == ASEE_RATE_EAGAIN || nonblock) {
+            spin_unlock(&ch->rate_lock);
+            return -EAGAIN;
+        }
+
+        /* Block until the buckets have drained enough */
+        spin_unlock(&ch->rate_lock);
+        kt = ns_to_ktime(now + wait);
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout_range(&kt, 0, HRTIMER_MODE_ABS);
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+        slept = ktime_get_ns() - now;
+    }
+
+    if (rate_b)
+        b->tat_bytes = max(b->tat_bytes, now) +
+                       div_u64((u64)len * NSEC_PER_SEC, rate_b);
+    if (rate_r)
+        b->tat_records = max(b->tat_records, now) +
+                         div_u64(NSEC_PER_SEC, rate_r);
+    b->last_ns = now;
+    b->bytes += len;
+    b->records++;
+    spin_unlock(&ch->rate_lock);
+    return 0;
+}
+
+/*
+ * Store len bytes from user space (or from kernel space if from_user is
+ * false), as write() does. Returns len, or what was taken of it before an
+ * error.
+ */
+static ssize_t asee_file_write(struct asee_file *af, const char __user *buff,
+                               size_t len, bool from_user, bool nonblock)
+{
+    size_t total = len;
+    ssize_t n;
+    char last;
+    int ret;
+
+    /* With asee_strip_newline, the newline that echo adds to its
+     * argument is consumed but not stored.
+     */
+    if (READ_ONCE(af->ch->strip_nl)) {
+        if (!from_user)
+            last = ((__force const char *)buff)[len - 1];
+        else if (get_user(last, buff + len - 1))
+            return -EFAULT;
+        if (last == '\n')
+            len--;
+        if (!len)
+            return total;
+    }
+
+    ret = asee_rate_limit(af->ch, len, nonblock);
+    if (ret)
+        return ret < 0 ? ret : total;
+
+    if (READ_ONCE(af->lane)) {
+        /* Lanes are for small messages, they are not combined */
+        n = asee_lane_write(af->ch, READ_ONCE(af->lane), buff, len,
+                            from_user, nonblock);
+    } else if (!READ_ONCE(af->wc_size)) {
+        n = asee_write_all(af->ch, buff, len, from_user, nonblock);
+    } else {
+        if (mutex_lock_interruptible(&af->wc_lock))
+            return -ERESTARTSYS;
+        if (af->wc_size)
+            n = asee_wc_write(af, buff, len, from_user, nonblock);
+        else
+            n = asee_write_all(af->ch, buff, len, from_user, nonblock);
+        mutex_unlock(&af->wc_lock);
+    }
+
+    if (n < 0 || (size_t)n < len)
+        return n;
+    return total;
+}
+
+/* cette fonction est appelée losqu'on effectue la commande echo au niveau du terminal
+ * (and by kernel_write()), see asee_file_write(). A write takes the first
+ * segment of from.
+ */
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    bool nonblock = (filp->f_flags & O_NONBLOCK) ||
+                    (iocb->ki_flags & IOCB_NOWAIT);
+    size_t len;
+    ssize_t n;
+
+    if (user_backed_iter(from)) {
+        len = min(iter_iov_len(from), iov_iter_count(from));
+        if (!len)
+            return 0;
+        n = asee_file_write(filp->private_data, iter_iov_addr(from), len,
+                            true, nonblock);
+    } else if (iov_iter_is_kvec(from)) {
+        len = min(from->kvec->iov_len - from->iov_offset,
+                  iov_iter_count(from));
+        if (!len)
+            return 0;
+        n = asee_file_write(filp->private_data,
+                            (__force const char __user *)from->kvec->iov_base +
+                            from->iov_offset, len, false, nonblock);
+    } else {
+        return -EINVAL;
+    }
+
+    if (n > 0)
+        iov_iter_advance(from, n);
+    return n;
+}
+
+     ret = asee_rate_limit(af->ch, len, nonblock);
+     if (ret)
+         return ret < 0 ? ret : total;
+
+     if (READ_ONCE(af->lane)) {
+         /* Lanes are for small messages, they are not combined */
+         n = asee_lane_write(af->ch, READ_ONCE(af->lane), buff, len, true,
+                             nonblock);
+     } else if (!READ_ONCE(af->wc_size)) {
+         n = asee_write_all(af->ch, buff, len, true, nonblock);
+     } else {
+         if (mutex_lock_interruptible(&af->wc_lock))
+             return -ERESTARTSYS;
+         if (af->wc_size)
+             n = asee_wc_write(af, buff, len, nonblock);
+         else
+             n = asee_write_all(af->ch, buff, len, true, nonblock);
+         mutex_unlock(&af->wc_lock);
+     }
+
+     if (n < 0 || (size_t)n < len)
+         return n;
+     return total;
+ }
+
+/*
+ * Page gifting: for large payloads, whole pages are handed over instead of
+ * being copied into the ring, by splice() from a pipe (typically filled by
+ * vmsplice() with SPLICE_F_GIFT) or by ASEE_IOC_GIFT. They are queued in
+ * order beside the byte ring, and handed out to splice() readers as they
+ * are; without any queued, splice() readers get the bytes of the channel.
+ *
+ * Of a pipe, only the pages gifted or stolen (SPLICE_F_MOVE) are kept, the
+ * others, which their owner may still change, are copied. The pages of
+ * ASEE_IOC_GIFT are pinned for as long as they are queued (FOLL_LONGTERM,
+ * so they are first moved out of CMA and movable zones), and the giver
+ * must not write to them afterwards. A reader gets a plain page reference.
+ */
+struct asee_gift {
+    struct list_head list;
+    struct pipe_buffer buf;
+    bool pinned; /* by pin_user_pages_fast(), or else referenced */
+};
+
+/* The buffers handed to readers only hold a page reference */
+static const struct pipe_buf_operations asee_gift_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get = generic_pipe_buf_get,
+};
+
+static bool asee_gift_ready(struct asee_channel *ch, unsigned int want)
+{
+    return READ_ONCE(ch->gift_count) >= want;
+}
+
+static bool asee_gift_room(struct asee_channel *ch, unsigned int want)
+{
+    return READ_ONCE(ch->gift_count) + want <= READ_ONCE(ch->gift_max);
+}
 
- static ssize_t device_write(struct file *filp, const char __user *buff, size_t len, loff_t *off) {
-
-    wait_event_interruptible(write_waitq, asee_buf_size > asee_buf_count);
-    int is_control_c = 0;
-    is_control_c = controlCcheck();
-    //si le processus en cours a été reveillé par un signal de control + c on l'interrompt
-    if(is_control_c){
-        module_put(THIS_MODULE); 
-            return -EINTR; 
-    }
-    
-     char *msg_ptr = circular_buffer;
-    for(int i = 0; i < len -1; i++){
-        get_user(msg_ptr[write_index], buff++);
-        asee_buf_count++;
-        wake_up(&read_waitq);
-        write_index = (write_index  + 1) % asee_buf_size;
-    }
-     return asee_buf_count;
- }
+/* Let go of a page that was queued, or was to be */
+static void asee_gift_put_page(struct page *page, bool pinned)
+{
+    if (pinned)
+        unpin_user_page(page);
+    else
+        put_page(page);
+}
+
+/* Queue len bytes at offset of page, whose reference (or pin) we now own */
+static int asee_gift_add(struct asee_channel *ch, struct page *page,
+                         unsigned int offset, unsigned int len, bool pinned)
+{
+    struct asee_gift *g = kmalloc(sizeof(*g), GFP_KERNEL_ACCOUNT);
+
+    if (!g)
+        return -ENOMEM;
+    g->buf = (struct pipe_buffer) {
+        .page = page,
+        .offset = offset,
+        .len = len,
+        .ops = &asee_gift_buf_ops,
+    };
+    g->pinned = pinned;
+
+    spin_lock(&ch->gift_lock);
+    list_add_tail(&g->list, &ch->gifts);
+    WRITE_ONCE(ch->gift_count, ch->gift_count + 1);
+    spin_unlock(&ch->gift_lock);
+
+    atomic_long_inc(&ch->gift_pages);
+    atomic_long_add(len, &ch->gift_bytes);
+    wake_up_interruptible(&ch->read_waitq);
+    return 0;
+}
+
+static void asee_gift_free_all(struct asee_channel *ch)
+{
+    struct asee_gift *g, *next;
+
+    list_for_each_entry_safe(g, next, &ch->gifts, list) {
+        asee_gift_put_page(g->buf.page, g->pinned);
+        kfree(g);
+    }
+}
+
+static int asee_gift_wait_room(struct asee_channel *ch, bool nonblock)
+{
+    return asee_wait(ch, &ch->write_waitq, asee_gift_room, 1,
+                     &ch->write_wakeups, READ_ONCE(ch->read_gap_ns), NULL,
+                     nonblock);
+}
+
+/* Queue a confirmed buffer of pipe: its page if it was gifted or can be
+ * stolen, a copy of its bytes otherwise
+ */
+static int asee_gift_pipe_buf(struct asee_channel *ch,
+                              struct pipe_inode_info *pipe,
+                              struct pipe_buffer *buf, unsigned int flags)
+{
+    struct page *page;
+    int ret;
+
+    if ((buf->flags & PIPE_BUF_FLAG_GIFT) ||
+        ((flags & SPLICE_F_MOVE) && pipe_buf_try_steal(pipe, buf))) {
+        /* A stolen page comes back locked */
+        if (!(buf->flags & PIPE_BUF_FLAG_GIFT))
+            unlock_page(buf->page);
+        if (!pipe_buf_get(pipe, buf))
+            return -EFAULT;
+        ret = asee_gift_add(ch, buf->page, buf->offset, buf->len, false);
+        if (ret)
+            put_page(buf->page);
+        return ret;
+    }
+
+    page = alloc_page(GFP_KERNEL_ACCOUNT);
+    if (!page)
+        return -ENOMEM;
+    memcpy_from_page(page_address(page), buf->page, buf->offset, buf->len);
+    ret = asee_gift_add(ch, page, 0, buf->len, false);
+    if (ret)
+        put_page(page);
+    return ret;
+}
+
+/*
+ * splice() from a pipe: take the buffers of the pipe, whole, as long as
+ * they fit in len. Gifted and stolen pages are referenced, the others
+ * copied (see asee_gift_pipe_buf()).
+ */
+static ssize_t device_splice_write(struct pipe_inode_info *pipe,
+                                   struct file *out, loff_t *ppos,
+                                   size_t len, unsigned int flags)
+{
+    struct asee_file *af = out->private_data;
+    struct asee_channel *ch = af->ch;
+    bool nonblock = (out->f_flags & O_NONBLOCK) ||
+                    (flags & SPLICE_F_NONBLOCK);
+    struct pipe_buffer *buf;
+    size_t done = 0, want = 0;
+    unsigned int tail;
+    int ret = 0, drop;
+
+    pipe_lock(pipe);
+    /* The rate limits see the whole of what the call takes */
+    for (tail = pipe->tail; tail != pipe->head; tail++) {
+        buf = &pipe->bufs[tail & (pipe->ring_size - 1)];
+        if (buf->len > len - want)
+            break;
+        want += buf->len;
+    }
+    drop = want ? asee_rate_limit(ch, want, nonblock) : 0;
+    if (drop < 0) {
+        pipe_unlock(pipe);
+        return drop;
+    }
+
+    while (done < want) {
+        buf = &pipe->bufs[pipe->tail & (pipe->ring_size - 1)];
+        /* Dropped buffers are consumed all the same */
+        if (!drop) {
+            ret = asee_gift_wait_room(ch, nonblock || done);
+            if (!ret)
+                ret = pipe_buf_confirm(pipe, buf);
+            if (!ret)
+                ret = asee_gift_pipe_buf(ch, pipe, buf, flags);
+            if (ret)
+                break;
+        }
+        done += buf->len;
+        pipe_buf_release(pipe, buf);
+        pipe->tail++;
+    }
+    pipe_unlock(pipe);
+
+    if (done) {
+        wake_up_interruptible_sync_poll(&pipe->wr_wait,
+                                        EPOLLOUT | EPOLLWRNORM);
+        return done;
+    }
+    return ret;
+}
+
+static bool asee_splice_ready(struct asee_channel *ch, unsigned int want)
+{
+    return asee_gift_ready(ch, want) || asee_read_ready(ch, want);
+}
+
+/* splice() to a pipe without gifts: the bytes, as read() gets them, copied
+ * to new pages
+ */
+static ssize_t asee_splice_read_bytes(struct asee_file *af,
+                                      struct pipe_inode_info *pipe,
+                                      size_t len, bool nonblock)
+{
+    struct page *page;
+    ssize_t done = 0, n = 0;
+
+    while (done < len && !pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+        page = alloc_page(GFP_KERNEL_ACCOUNT);
+        if (!page) {
+            n = -ENOMEM;
+            break;
+        }
+        n = asee_file_read(af, (__force char __user *)page_address(page),
+                           min_t(size_t, len - done, PAGE_SIZE), false,
+                           nonblock || done);
+        if (n <= 0) {
+            put_page(page);
+            break;
+        }
+        pipe->bufs[pipe->head & (pipe->ring_size - 1)] = (struct pipe_buffer) {
+            .page = page,
+            .len = n,
+            .ops = &asee_gift_buf_ops,
+        };
+        pipe->head++;
+        done += n;
+    }
+    return done ? done : n;
+}
+
+/*
+ * splice() to a pipe: hand out the queued pages, in order. A buffer larger
+ * than what is left of len is split, both parts sharing the page. With no
+ * page queued, the bytes of the channel are copied instead.
+ */
+static ssize_t device_splice_read(struct file *in, loff_t *ppos,
+                                  struct pipe_inode_info *pipe, size_t len,
+                                  unsigned int flags)
+{
+    struct asee_file *af = in->private_data;
+    struct asee_channel *ch = af->ch;
+    bool nonblock = (in->f_flags & O_NONBLOCK) ||
+                    (flags & SPLICE_F_NONBLOCK);
+    struct pipe_buffer buf;
+    struct asee_gift *g;
+    ssize_t done = 0;
+    int ret;
+
+    ret = asee_wait(ch, &ch->read_waitq, asee_splice_ready, 1,
+                    &ch->read_wakeups, READ_ONCE(ch->write_gap_ns), NULL,
+                    nonblock);
+    if (ret)
+        return ret;
+    if (!READ_ONCE(ch->gift_count))
+        return asee_splice_read_bytes(af, pipe, len, nonblock);
+
+    while (done < len && !pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+        spin_lock(&ch->gift_lock);
+        g = list_first_entry_or_null(&ch->gifts, struct asee_gift, list);
+        if (!g) {
+            spin_unlock(&ch->gift_lock);
+            break;
+        }
+        buf = g->buf;
+        get_page(buf.page);
+        if (g->buf.len > len - done) {
+            buf.len = len - done;
+            g->buf.offset += buf.len;
+            g->buf.len -= buf.len;
+            g = NULL;
+        } else {
+            list_del(&g->list);
+            WRITE_ONCE(ch->gift_count, ch->gift_count - 1);
+        }
+        spin_unlock(&ch->gift_lock);
+        if (g) {
+            asee_gift_put_page(g->buf.page, g->pinned);
+            kfree(g);
+        }
+
+        pipe->bufs[pipe->head & (pipe->ring_size - 1)] = buf;
+        pipe->head++;
+        done += buf.len;
+    }
+
+    atomic_long_add(done, &ch->bytes_read);
+    wake_up_interruptible(&ch->write_waitq);
+    return done;
+}
+
+/*
+ * ASEE_IOC_GIFT: queue the pages of a page-aligned user range. Returns the
+ * number of bytes queued.
+ */
+static long asee_gift_user(struct asee_channel *ch,
+                           const struct asee_gift_range *range, bool nonblock)
+{
+    struct page *pages[16];
+    unsigned long addr = range->addr;
+    unsigned long nr = range->len >> PAGE_SHIFT;
+    long done = 0;
+    int i, n, ret = 0;
+
+    if (!PAGE_ALIGNED(addr) || !PAGE_ALIGNED(range->len))
+        return -EINVAL;
+    ret = asee_rate_limit(ch, range->len, nonblock);
+    if (ret)
+        return ret < 0 ? ret : range->len;
+
+    while (nr) {
+        n = min_t(unsigned long, nr, ARRAY_SIZE(pages));
+        n = min_t(unsigned int, n, READ_ONCE(ch->gift_max));
+        ret = asee_wait(ch, &ch->write_waitq, asee_gift_room, n,
+                        &ch->write_wakeups, READ_ONCE(ch->read_gap_ns), NULL,
+                        nonblock || done);
+        if (ret)
+            break;
+        n = pin_user_pages_fast(addr, n, FOLL_LONGTERM, pages);
+        if (n <= 0) {
+            ret = n ? n : -EFAULT;
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (!ret)
+                ret = asee_gift_add(ch, pages[i], 0, PAGE_SIZE, true);
+            if (ret)
+                unpin_user_page(pages[i]);
+            else
+                done += PAGE_SIZE;
+        }
+        if (ret)
+            break;
+        addr += n * PAGE_SIZE;
+        nr -= n;
+    }
+    return done ? done : ret;
+}
+
+/* Called on each close() of the file: publish what is staged */
+static int device_flush(struct file *filp, fl_owner_t id)
+{
+    struct asee_file *af = filp->private_data;
+    int ret;
+
+    if (!READ_ONCE(af->wc_size))
+        return 0;
+    mutex_lock(&af->wc_lock);
+    ret = asee_wc_flush(af, filp->f_flags & O_NONBLOCK);
+    mutex_unlock(&af->wc_lock);
+    return ret;
+}
+
+static int device_fsync(struct file *filp, loff_t start, loff_t end,
+                        int datasync)
+{
+    struct asee_file *af = filp->private_data;
+    int ret;
+
+    if (mutex_lock_interruptible(&af->wc_lock))
+        return -ERESTARTSYS;
+    ret = asee_wc_flush(af, false);
+    mutex_unlock(&af->wc_lock);
+    return ret;
+}
+
+/*
+ * The ring is mapped page by page as it is touched, with PMD mappings when
+ * it is made of huge pages. A mapping holds a reference on the ring it was
+ * made of, which outlives a resize or a NUMA move.
+ */
+static void asee_vm_open(struct vm_area_struct *vma)
+{
+    struct asee_ring *ring = vma->vm_private_data;
+
+    kref_get(&ring->ref);
+}
+
+static void asee_vm_close(struct vm_area_struct *vma)
+{
+    asee_ring_put(vma->vm_private_data);
+}
+
+static vm_fault_t asee_vm_fault(struct vm_fault *vmf)
+{
+    struct asee_ring *ring = vmf->vma->vm_private_data;
+
+    if (vmf->pgoff >= 2 * ring->nr_pages)
+        return VM_FAULT_SIGBUS;
+    return vmf_insert_pfn(vmf->vma, vmf->address,
+                          page_to_pfn(ring->pages[vmf->pgoff]));
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static vm_fault_t asee_vm_pmd_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct asee_ring *ring = vma->vm_private_data;
+    unsigned long addr = vmf->address & HPAGE_PMD_MASK;
+    pgoff_t pgoff = linear_page_index(vma, addr);
+
+    /* Only whole huge pages, and only where the mapping is aligned on them
+     * (device_get_unmapped_area() sees to that)
+     */
+    if (!ring->order || addr < vma->vm_start ||
+        addr + HPAGE_PMD_SIZE > vma->vm_end || pgoff % HPAGE_PMD_NR)
+        return VM_FAULT_FALLBACK;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+    return vmf_insert_pfn_pmd(vmf, page_to_pfn(ring->pages[pgoff]), false);
+#else
+    return vmf_insert_pfn_pmd(vmf, page_to_pfn_t(ring->pages[pgoff]), false);
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t asee_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+    return order == PMD_ORDER ? asee_vm_pmd_fault(vmf) : VM_FAULT_FALLBACK;
+}
+#else
+static vm_fault_t asee_vm_huge_fault(struct vm_fault *vmf,
+                                     enum page_entry_size pe_size)
+{
+    return pe_size == PE_SIZE_PMD ? asee_vm_pmd_fault(vmf) : VM_FAULT_FALLBACK;
+}
+#endif
+#endif
+
+static const struct vm_operations_struct asee_vm_ops = {
+    .open = asee_vm_open,
+    .close = asee_vm_close,
+    .fault = asee_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = asee_vm_huge_fault,
+#endif
+};
+
+/*
+ * Status page. status_timer is its only writer, and runs while the page is
+ * mapped: nothing is done on the data path for it.
+ */
+static void asee_status_update(struct asee_channel *ch)
+{
+    struct asee_status *st = ch->status;
+    unsigned long prod = smp_load_acquire(&ch->prod_tail);
+    unsigned long cons = READ_ONCE(ch->cons_tail);
+    u32 seq = st->seq;
+
+    WRITE_ONCE(st->seq, seq + 1);
+    smp_wmb();
+    WRITE_ONCE(st->interval_us, READ_ONCE(ch->status_us));
+    WRITE_ONCE(st->time_ns, ktime_get_ns());
+    WRITE_ONCE(st->prod_tail, prod);
+    WRITE_ONCE(st->cons_tail, cons);
+    WRITE_ONCE(st->fill, prod - cons);
+    WRITE_ONCE(st->capacity, READ_ONCE(ch->asee_buf_size));
+    WRITE_ONCE(st->ring_size, READ_ONCE(ch->ring_size));
+    WRITE_ONCE(st->read_waiters, atomic_read(&ch->read_waiters));
+    WRITE_ONCE(st->write_waiters, atomic_read(&ch->write_waiters));
+    WRITE_ONCE(st->policy, READ_ONCE(ch->policy));
+    WRITE_ONCE(st->bytes_read, atomic_long_read(&ch->bytes_read));
+    WRITE_ONCE(st->bytes_written, atomic_long_read(&ch->bytes_written));
+    WRITE_ONCE(st->reads, atomic_long_read(&ch->reads));
+    WRITE_ONCE(st->dropped, atomic_long_read(&ch->dropped));
+    WRITE_ONCE(st->drop_events, atomic_long_read(&ch->drop_events));
+    WRITE_ONCE(st->lanes_len, atomic_long_read(&ch->lanes_len));
+    WRITE_ONCE(st->spill_len, READ_ONCE(ch->spill_len));
+    smp_wmb();
+    WRITE_ONCE(st->seq, seq + 2);
+}
+
+static enum hrtimer_restart asee_status_timer_fn(struct hrtimer *timer)
+{
+    struct asee_channel *ch = container_of(timer, struct asee_channel,
+                                           status_timer);
+
+    if (!atomic_read(&ch->status_maps))
+        return HRTIMER_NORESTART;
+    asee_status_update(ch);
+    hrtimer_forward_now(timer, us_to_ktime(READ_ONCE(ch->status_us)));
+    return HRTIMER_RESTART;
+}
+
+static void asee_status_vm_open(struct vm_area_struct *vma)
+{
+    struct asee_channel *ch = vma->vm_private_data;
+
+    /* The first mapping starts the refreshes, from now */
+    if (atomic_inc_return(&ch->status_maps) == 1)
+        hrtimer_start(&ch->status_timer, 0, HRTIMER_MODE_REL_SOFT);
+}
+
+static void asee_status_vm_close(struct vm_area_struct *vma)
+{
+    struct asee_channel *ch = vma->vm_private_data;
+
+    atomic_dec(&ch->status_maps);
+}
+
+static const struct vm_operations_struct asee_status_vm_ops = {
+    .open = asee_status_vm_open,
+    .close = asee_status_vm_close,
+};
+
+static int asee_status_mmap(struct asee_channel *ch,
+                            struct vm_area_struct *vma)
+{
+    int error;
+
+    if (vma_pages(vma) != 1)
+        return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    error = remap_pfn_range(vma, vma->vm_start,
+                            virt_to_phys(ch->status) >> PAGE_SHIFT,
+                            PAGE_SIZE, vma->vm_page_prot);
+    if (error)
+        return error;
+    vma->vm_ops = &asee_status_vm_ops;
+    vma->vm_private_data = ch;
+    asee_status_vm_open(vma);
+    return 0;
+}
+
+/*
+ * Sink: a kthread that drains lane 0 of a channel into a file, as a reader
+ * would, without going through user space. It takes what is there, up to
+ * sink_batch bytes, once there is a whole batch or every
+ * ASEE_SINK_DELAY_MS. Bytes that cannot be written are counted as dropped.
+ */
+static bool asee_sink_ready(struct asee_channel *ch)
+{
+    return smp_load_acquire(&ch->prod_tail) - READ_ONCE(ch->cons_head) >=
+           ch->sink_batch;
+}
+
+/* Move a batch from the ring to sink_buf */
+static size_t asee_sink_fill(struct asee_channel *ch)
+{
+    struct asee_resv r;
+    size_t done = 0;
+
+    /* Elastic channels have no ring, and an idle one need not get one */
+    if (READ_ONCE(ch->elastic) || !READ_ONCE(ch->circular_buffer))
+        return 0;
+    while (done < ch->sink_batch &&
+           !asee_peek(ch, ch->sink_batch - done, false, &r)) {
+        memcpy(ch->sink_buf + done, r.data, r.len);
+        done += r.len;
+        asee_release(ch, &r);
+    }
+    return done;
+}
+
+static void asee_sink_fail(struct asee_channel *ch, int error)
+{
+    atomic_long_inc(&ch->sink_errors);
+    WRITE_ONCE(ch->sink_error, error);
+    pr_warn_ratelimited("%s: sink: error %d\n", ch->name, error);
+}
+
+static void asee_sink_fsync(struct asee_channel *ch)
+{
+    int error = vfs_fsync(ch->sink_file, 1);
+
+    if (error)
+        asee_sink_fail(ch, error);
+    else
+        atomic_long_inc(&ch->sink_fsyncs);
+}
+
+static int asee_sink_fn(void *data)
+{
+    struct asee_channel *ch = data;
+    unsigned long bytes, rate_bytes = atomic_long_read(&ch->sink_bytes);
+    u64 now, fsync_ns, rate_ns;
+    unsigned int fsync_ms;
+    loff_t pos = 0; /* O_APPEND: the file writes at its end */
+    size_t done;
+    ssize_t n;
+
+    fsync_ns = rate_ns = ktime_get_ns();
+    while (!kthread_should_stop()) {
+        wait_event_interruptible_timeout(ch->read_waitq,
+                                         asee_sink_ready(ch) ||
+                                         kthread_should_stop(),
+                                         msecs_to_jiffies(ASEE_SINK_DELAY_MS));
+
+        done = asee_sink_fill(ch);
+        if (done) {
+            n = kernel_write(ch->sink_file, ch->sink_buf, done, &pos);
+            if (n != done) {
+                asee_sink_fail(ch, n < 0 ? n : -EIO);
+                asee_account_drop(ch, done - max_t(ssize_t, n, 0));
+            }
+            if (n > 0)
+                atomic_long_add(n, &ch->sink_bytes);
+            atomic_long_inc(&ch->sink_batches);
+        }
+
+        now = ktime_get_ns();
+        fsync_ms = READ_ONCE(ch->sink_fsync_ms);
+        if (fsync_ms && now - fsync_ns >= (u64)fsync_ms * NSEC_PER_MSEC) {
+            asee_sink_fsync(ch);
+            fsync_ns = now;
+        }
+        if (now - rate_ns >= NSEC_PER_SEC) {
+            bytes = atomic_long_read(&ch->sink_bytes);
+            WRITE_ONCE(ch->sink_rate,
+                       div64_u64((u64)(bytes - rate_bytes) * NSEC_PER_SEC,
+                                 now - rate_ns));
+            rate_bytes = bytes;
+            rate_ns = now;
+        }
+    }
+
+    if (READ_ONCE(ch->sink_fsync_ms))
+        asee_sink_fsync(ch);
+    return 0;
+}
+
+/* Open path and start draining into it. Called with sink_lock held, while
+ * detached.
+ */
+static int asee_sink_attach(struct asee_channel *ch, const char *path)
+{
+    struct task_struct *task;
+    struct file *file;
+    int error;
+
+    lockdep_assert_held(&ch->sink_lock);
+    ch->sink_path = kstrdup(path, GFP_KERNEL);
+    ch->sink_buf = kvmalloc(ch->sink_batch, GFP_KERNEL);
+    if (!ch->sink_path || !ch->sink_buf) {
+        error = -ENOMEM;
+        goto fail;
+    }
+    file = filp_open(path, O_WRONLY | O_CREAT | O_APPEND | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        error = PTR_ERR(file);
+        goto fail;
+    }
+    ch->sink_file = file;
+
+    task = kthread_run(asee_sink_fn, ch, "asee_sink/%d", ch->minor);
+    if (IS_ERR(task)) {
+        error = PTR_ERR(task);
+        fput(ch->sink_file);
+        ch->sink_file = NULL;
+        goto fail;
+    }
+    ch->sink_task = task;
+    WRITE_ONCE(ch->sink_rate, 0);
+    return 0;
+fail:
+    kvfree(ch->sink_buf);
+    kfree(ch->sink_path);
+    ch->sink_buf = NULL;
+    ch->sink_path = NULL;
+    return error;
+}
+
+/* Stop the sink, if any. What it has not taken stays in the channel.
+ * Called with sink_lock held.
+ */
+static void asee_sink_detach(struct asee_channel *ch)
+{
+    lockdep_assert_held(&ch->sink_lock);
+    if (!ch->sink_task)
+        return;
+    kthread_stop(ch->sink_task);
+    ch->sink_task = NULL;
+    fput(ch->sink_file);
+    ch->sink_file = NULL;
+    kvfree(ch->sink_buf);
+    ch->sink_buf = NULL;
+    kfree(ch->sink_path);
+    ch->sink_path = NULL;
+    WRITE_ONCE(ch->sink_rate, 0);
+}
+
+/*
+ * Map the ring read-only, twice back to back as in the kernel, so that a
+ * mapping of twice ASEE_IOC_GET_RING's ring_size sees any record in one
+ * piece. The mapping keeps the pages it got: once the ring is replaced
+ * (resize, NUMA move or asee_huge_pages, see the gen of ASEE_IOC_GET_RING),
+ * map it again. The status page is mapped at ASEE_MMAP_STATUS instead.
+ */
+static int device_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct asee_file *af = filp->private_data;
+    struct asee_channel *ch = af->ch;
+    struct asee_ring *ring;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EACCES;
+    if (vma->vm_pgoff == ASEE_MMAP_STATUS >> PAGE_SHIFT)
+        return asee_status_mmap(ch, vma);
+    if (vma->vm_pgoff)
+        return -EINVAL;
+
+    spin_lock(&ch->ring_lock);
+    ring = ch->ring;
+    if (ring)
+        kref_get(&ring->ref);
+    spin_unlock(&ch->ring_lock);
+
+    /* Nothing was written yet, or the ring was freed while idle */
+    if (!ring)
+        return -ENODATA;
+    if (vma_pages(vma) > 2 * ring->nr_pages) {
+        asee_ring_put(ring);
+        return -EINVAL;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_mod(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+#else
+    vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    vma->vm_ops = &asee_vm_ops;
+    vma->vm_private_data = ring;
+    return 0;
+}
+
+/* Huge page rings are mapped at addresses aligned on huge pages */
+static unsigned long device_get_unmapped_area(struct file *filp,
+                                              unsigned long addr,
+                                              unsigned long len,
+                                              unsigned long pgoff,
+                                              unsigned long flags)
+{
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    struct asee_file *af = filp->private_data;
+
+    if (READ_ONCE(af->ch->huge))
+        return thp_get_unmapped_area(filp, addr, len, pgoff, flags);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+    return mm_get_unmapped_area(current->mm, filp, addr, len, pgoff, flags);
+#else
+    return current->mm->get_unmapped_area(filp, addr, len, pgoff, flags);
+#endif
+}
+
+/* Readable, writable, and EPOLLPRI when data was lost since the file last
+ * asked with ASEE_IOC_GET_LOST.
+ */
+static __poll_t device_poll(struct file *filp, poll_table *wait)
+{
+    struct asee_file *af = filp->private_data;
+    struct asee_channel *ch = af->ch;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &ch->read_waitq, wait);
+    poll_wait(filp, &ch->write_waitq, wait);
 
+    if (af->member >= 0) {
+        if (asee_member_readable(ch, af->member))
+            mask |= EPOLLIN | EPOLLRDNORM;
+    } else if (asee_readable(ch, max(af->read_min, 1u)) ||
+               asee_gift_ready(ch, 1) || READ_ONCE(ch->spill_len)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (af->lane ? asee_lane_room(ch, af->lane) : asee_write_ready(ch, 1))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    if (atomic_long_read(&ch->dropped) != READ_ONCE(af->lost_seen))
+        mask |= EPOLLPRI;
+    return mask;
+}
+
+static long device_ioctl(struct file *filp, unsigned int cmd,
+                         unsigned long arg)
+{
+    struct asee_file *af = filp->private_data;
+    struct asee_read_thresh thresh;
+    struct asee_write_combine wc;
+    struct asee_ring_info ri = {};
+    struct asee_gift_range range;
+    struct asee_lane_write lw;
+    struct asee_keyed_write kw;
+    __u64 shards = 0;
+    __u32 lane;
+    size_t n;
+    int s, ret;
+    struct asee_channel *ch = af->ch;
+    long dropped;
+    __u64 lost;
+
+    switch (cmd) {
+    case ASEE_IOC_GET_LOST:
+        dropped = atomic_long_read(&af->ch->dropped);
+        lost = dropped - xchg(&af->lost_seen, dropped);
+        return put_user(lost, (__u64 __user *)arg);
+    case ASEE_IOC_SET_READ_THRESH:
+        if (copy_from_user(&thresh, (void __user *)arg, sizeof(thresh)))
+            return -EFAULT;
+        WRITE_ONCE(af->read_min, thresh.min_bytes);
+        WRITE_ONCE(af->read_timeout_us, thresh.timeout_us);
+        return 0;
+    case ASEE_IOC_GET_READ_THRESH:
+        thresh.min_bytes = READ_ONCE(af->read_min);
+        thresh.timeout_us = READ_ONCE(af->read_timeout_us);
+        if (copy_to_user((void __user *)arg, &thresh, sizeof(thresh)))
+            return -EFAULT;
+        return 0;
+    case ASEE_IOC_SET_WRITE_COMBINE:
+        if (copy_from_user(&wc, (void __user *)arg, sizeof(wc)))
+            return -EFAULT;
+        return asee_wc_setup(af, wc.size, wc.flush_us);
+    case ASEE_IOC_GET_RING:
+        percpu_down_read(&ch->resize_sem);
+        ri.cons_tail = READ_ONCE(ch->cons_tail);
+        ri.prod_tail = smp_load_acquire(&ch->prod_tail);
+        ri.ring_size = ch->ring_size;
+        ri.capacity = ch->asee_buf_size;
+        ri.gen = atomic_read(&ch->ring_gen);
+        percpu_up_read(&ch->resize_sem);
+        if (copy_to_user((void __user *)arg, &ri, sizeof(ri)))
+            return -EFAULT;
+        return 0;
+    case ASEE_IOC_GIFT:
+        if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+            return -EFAULT;
+        return asee_gift_user(ch, &range, filp->f_flags & O_NONBLOCK);
+    case ASEE_IOC_SET_LANE:
+        if (get_user(lane, (__u32 __user *)arg))
+            return -EFAULT;
+        if (lane >= ASEE_NR_LANES)
+            return -EINVAL;
+        WRITE_ONCE(af->lane, lane);
+        return 0;
+    case ASEE_IOC_WRITE_LANE:
+        if (copy_from_user(&lw, (void __user *)arg, sizeof(lw)))
+            return -EFAULT;
+        if (lw.lane >= ASEE_NR_LANES)
+            return -EINVAL;
+        if (!access_ok(u64_to_user_ptr(lw.buf), lw.len))
+            return -EFAULT;
+        n = lw.lane ? lw.len : min_t(size_t, lw.len, ASEE_MAX_CHUNK);
+        ret = asee_rate_limit(ch, n, filp->f_flags & O_NONBLOCK);
+        if (ret)
+            return ret < 0 ? ret : n;
+        if (!lw.lane)
+            return asee_write_all(ch, u64_to_user_ptr(lw.buf), n, true,
+                                  filp->f_flags & O_NONBLOCK);
+        return asee_lane_write(ch, lw.lane, u64_to_user_ptr(lw.buf), lw.len,
+                               true, filp->f_flags & O_NONBLOCK);
+    case ASEE_IOC_WRITE_KEYED:
+        if (copy_from_user(&kw, (void __user *)arg, sizeof(kw)))
+            return -EFAULT;
+        if (!kw.len || kw.len > ASEE_MAX_CHUNK)
+            return -EINVAL;
+        ret = asee_rate_limit(ch, kw.len, filp->f_flags & O_NONBLOCK);
+        if (ret)
+            return ret < 0 ? ret : kw.len;
+        return asee_keyed_write(ch, u64_to_user_ptr(kw.buf), kw.len, kw.key,
+                                filp->f_flags & O_NONBLOCK);
+    case ASEE_IOC_JOIN_GROUP:
+        return asee_group_join(af);
+    case ASEE_IOC_LEAVE_GROUP:
+        return asee_group_leave(af);
+    case ASEE_IOC_GET_SHARDS:
+        down_read(&ch->group_sem);
+        for (s = 0; s < ch->nr_shards; s++)
+            if (af->member >= 0 && ch->shards[s].owner == af->member)
+                shards |= 1ULL << s;
+        up_read(&ch->group_sem);
+        return put_user(shards, (__u64 __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* In-kernel interface, see asee_kernel.h */
+
+struct asee_channel *asee_channel_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < nr_channels; i++)
+        if (!strcmp(asee_chans[i]->name, name))
+            return asee_chans[i];
+    return NULL;
+}
+EXPORT_SYMBOL_GPL(asee_channel_find);
+
+ssize_t asee_kernel_write(struct asee_channel *ch, const void *buf,
+                          size_t len, bool nonblock)
+{
+    return asee_write_all(ch, (__force const char __user *)buf, len, false,
+                          nonblock);
+}
+EXPORT_SYMBOL_GPL(asee_kernel_write);
+
+/*
+ * Take what a reservation holds until it is committed or released: the
+ * read side of resize_sem, then the backend lock. From atomic context the
+ * semaphore is only tried, and the mutex backend cannot be used at all.
+ *
+ * percpu_down_read_trylock() and percpu_up_read() never sleep, so both are
+ * fine in softirq context, and a resize in progress on this CPU makes the
+ * trylock fail rather than deadlock. Lockdep does not record trylocks as
+ * taken in softirq context either, so the write side, taken with softirqs
+ * enabled, raises no inconsistent-state report.
+ */
+static int asee_kernel_lock(struct asee_channel *ch, bool atomic)
+{
+    if (!atomic)
+        percpu_down_read(&ch->resize_sem);
+    else if (!percpu_down_read_trylock(&ch->resize_sem))
+        return -EAGAIN;
+    if (atomic && ch->sync == ASEE_SYNC_MUTEX) {
+        percpu_up_read(&ch->resize_sem);
+        return -EOPNOTSUPP;
+    }
+    asee_sync_backends[ch->sync].lock(ch);
+    return 0;
+}
+
+static void asee_kernel_unlock(struct asee_channel *ch)
+{
+    asee_sync_backends[ch->sync].unlock(ch);
+    percpu_up_read(&ch->resize_sem);
+}
+
+/* Checks common to both sides, before the lock is taken */
+static int asee_kernel_usable(struct asee_channel *ch, bool atomic)
+{
+    int error;
+
+    if (READ_ONCE(ch->elastic))
+        return -EOPNOTSUPP;
+    if (!READ_ONCE(ch->circular_buffer)) {
+        if (atomic)
+            return -ENODATA;
+        error = asee_ring_populate(ch);
+        if (error)
+            return error;
+    }
+    return 0;
+}
+
+int asee_reserve(struct asee_channel *ch, size_t len, bool atomic,
+                 struct asee_resv *r)
+{
+    enum asee_policy policy = READ_ONCE(ch->policy);
+    int error;
+
+    if (!len || len > ASEE_MAX_CHUNK)
+        return -EINVAL;
+    error = asee_kernel_usable(ch, atomic);
+    if (error)
+        return error;
+    error = asee_kernel_lock(ch, atomic);
+    if (error)
+        return error;
+
+    /* The ring may have gone, or changed mode, before we got the lock */
+    if (ch->elastic || !ch->circular_buffer) {
+        error = ch->elastic ? -EOPNOTSUPP : -EAGAIN;
+        goto out;
+    }
+    if (len > ch->asee_buf_size) {
+        error = -EMSGSIZE;
+        goto out;
+    }
+    /* Spilled data goes first */
+    if (READ_ONCE(ch->spill_len)) {
+        error = -EAGAIN;
+        goto out;
+    }
+
+    while (!asee_prod_reserve_all(ch, len, &r->pos)) {
+        if (policy == ASEE_POLICY_OVERWRITE_OLDEST) {
+            asee_drop_oldest(ch, len);
+            continue;
+        }
+        /* The record is dropped once, and the caller told not to retry */
+        if (policy == ASEE_POLICY_DROP_NEWEST) {
+            asee_account_drop(ch, len);
+            error = -ENOBUFS;
+        } else {
+            error = -EAGAIN;
+        }
+        goto out;
+    }
+    r->data = asee_ring_ptr(ch, r->pos);
+    r->len = len;
+    return 0;
+out:
+    asee_kernel_unlock(ch);
+    return error;
+}
+EXPORT_SYMBOL_GPL(asee_reserve);
+
+void asee_commit(struct asee_channel *ch, struct asee_resv *r)
+{
+    asee_prod_commit(ch, r->pos, r->len);
+    asee_kernel_unlock(ch);
+
+    atomic_long_add(r->len, &ch->bytes_written);
+    asee_update_avg(&ch->write_avg, r->len);
+    asee_update_gap(&ch->last_write_ns, &ch->write_gap_ns);
+    asee_wake_readers(ch);
+}
+EXPORT_SYMBOL_GPL(asee_commit);
+
+int asee_peek(struct asee_channel *ch, size_t len, bool atomic,
+              struct asee_resv *r)
+{
+    int error;
+
+    if (!len)
+        return -EINVAL;
+    error = asee_kernel_usable(ch, atomic);
+    if (error)
+        return error;
+    if (!atomic)
+        asee_spill_refill_reader(ch);
+    error = asee_kernel_lock(ch, atomic);
+    if (error)
+        return error;
+
+    if (ch->elastic || !ch->circular_buffer) {
+        asee_kernel_unlock(ch);
+        return ch->elastic ? -EOPNOTSUPP : -EAGAIN;
+    }
+    r->len = asee_cons_reserve(ch, min_t(size_t, len, ASEE_MAX_CHUNK),
+                               &r->pos);
+    if (!r->len) {
+        asee_kernel_unlock(ch);
+        return -EAGAIN;
+    }
+    r->data = asee_ring_ptr(ch, r->pos);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(asee_peek);
+
+void asee_release(struct asee_channel *ch, struct asee_resv *r)
+{
+    asee_cons_commit(ch, r->pos, r->len);
+    asee_kernel_unlock(ch);
+
+    atomic_long_add(r->len, &ch->bytes_read);
+    atomic_long_inc(&ch->reads);
+    asee_update_avg(&ch->read_avg, r->len);
+    asee_update_gap(&ch->last_read_ns, &ch->read_gap_ns);
+    asee_irq_read_mark(ch);
+    asee_wake_writers(ch);
+}
+EXPORT_SYMBOL_GPL(asee_release);
+
+/* Is there room for want more bytes in the ring? */
+static bool asee_ring_room(struct asee_channel *ch, unsigned int want)
+{
+    return READ_ONCE(ch->prod_head) - smp_load_acquire(&ch->cons_tail) +
+           want <= READ_ONCE(ch->asee_buf_size);
+}
+
+/* Are there want bytes in the ring that no reader has reserved yet? */
+static bool asee_ring_data(struct asee_channel *ch, unsigned int want)
+{
+    return smp_load_acquire(&ch->prod_tail) - READ_ONCE(ch->cons_head) >= want;
+}
+
+int asee_kernel_wait(struct asee_channel *ch, bool write, size_t len,
+                     unsigned int timeout_us)
+{
+    ktime_t deadline = ktime_add_us(ktime_get(), timeout_us);
+
+    if (!len || len > ASEE_MAX_CHUNK)
+        return -EINVAL;
+    if (write)
+        return asee_wait(ch, &ch->write_waitq, asee_ring_room, len,
+                         &ch->write_wakeups, READ_ONCE(ch->read_gap_ns),
+                         timeout_us ? &deadline : NULL, false);
+    return asee_wait(ch, &ch->read_waitq, asee_ring_data, len,
+                     &ch->read_wakeups, READ_ONCE(ch->write_gap_ns),
+                     timeout_us ? &deadline : NULL, false);
+}
+EXPORT_SYMBOL_GPL(asee_kernel_wait);
 
 module_init(chardev_init);
 module_exit(chardev_exit);
@@ -0,0 +1,157 @@
+/*
+ * asee_mod.h - ioctl interface of /dev/asee_mod, shared between the module
+ * and the user space programs that talk to it.
+ */
+
+#ifndef ASEE_MOD_H
+#define ASEE_MOD_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define ASEE_IOC_MAGIC 'a'
+
+/* Number of bytes the channel has dropped (overwrite-oldest or drop-newest
+ * policies) since this file last asked, or since it was opened.
+ */
+#define ASEE_IOC_GET_LOST _IOR(ASEE_IOC_MAGIC, 1, __u64)
+
+/* Read thresholds of a file, like termios' VMIN/VTIME: a blocking read
+ * returns once min_bytes are available (at most the size of the read), or
+ * timeout_us after the first byte came, whichever comes first. A
+ * timeout_us of 0 waits for min_bytes without limit. The defaults are
+ * taken from asee_read_min and asee_read_timeout_us when the file is
+ * opened.
+ */
+struct asee_read_thresh {
+    __u32 min_bytes;
+    __u32 timeout_us;
+};
+
+#define ASEE_IOC_SET_READ_THRESH _IOW(ASEE_IOC_MAGIC, 2, struct asee_read_thresh)
+#define ASEE_IOC_GET_READ_THRESH _IOR(ASEE_IOC_MAGIC, 3, struct asee_read_thresh)
+
+/* Write combining of a file: writes smaller than size bytes are staged,
+ * and published together once size bytes are staged, flush_us after the
+ * first staged byte (0 for no deadline), or on close() and fsync(). A size
+ * of 0 turns it off. At most 64 KiB.
+ */
+struct asee_write_combine {
+    __u32 size;
+    __u32 flush_us;
+};
+
+#define ASEE_IOC_SET_WRITE_COMBINE _IOW(ASEE_IOC_MAGIC, 4, struct asee_write_combine)
+
+/* Where the data is in the ring mapped by mmap(): the bytes from position
+ * cons_tail to prod_tail, starting at offset cons_tail % ring_size of the
+ * mapping, which is contiguous if the mapping is 2 * ring_size long. The
+ * positions count bytes since the ring was created or last replaced.
+ * capacity is the asee_buf_size of the channel. gen changes whenever the
+ * ring is replaced, and a mapping made before then is stale. ring_size is 0
+ * while the channel has no ring: it gets one on its first write, and an
+ * idle, empty and unmapped ring can be freed under memory pressure.
+ *
+ * This only looks: the data stays in the channel until it is read(), and
+ * can be overwritten once it has been.
+ */
+struct asee_ring_info {
+    __u64 cons_tail;
+    __u64 prod_tail;
+    __u32 ring_size;
+    __u32 capacity;
+    __u32 gen;
+    __u32 pad;
+};
+
+#define ASEE_IOC_GET_RING _IOR(ASEE_IOC_MAGIC, 5, struct asee_ring_info)
+
+/* Hand the pages of [addr, addr + len) to the channel without copying
+ * them, as splice() from a vmsplice()d pipe does. Both must be page
+ * aligned. The pages are read back, in order, by splice() from the device,
+ * not by read(). The caller must not write to them afterwards. Returns the
+ * number of bytes queued.
+ */
+struct asee_gift_range {
+    __u64 addr;
+    __u64 len;
+};
+
+#define ASEE_IOC_GIFT _IOW(ASEE_IOC_MAGIC, 6, struct asee_gift_range)
+
+/* Priority lanes: 0 is the bulk lane, 1 to ASEE_NR_LANES - 1 are read
+ * before it (strictly, or in weighted-fair mode, see asee_lane_mode).
+ * ASEE_IOC_SET_LANE sets the lane of the write()s of the file,
+ * ASEE_IOC_WRITE_LANE does one write to the given lane and returns the
+ * number of bytes written.
+ */
+#define ASEE_NR_LANES 4
+
+struct asee_lane_write {
+    __u64 buf;
+    __u32 len;
+    __u32 lane;
+};
+
+#define ASEE_IOC_SET_LANE _IOW(ASEE_IOC_MAGIC, 7, __u32)
+#define ASEE_IOC_WRITE_LANE _IOW(ASEE_IOC_MAGIC, 8, struct asee_lane_write)
+
+/* Keyed records and consumer groups. ASEE_IOC_WRITE_KEYED queues a record
+ * of len bytes in the shard of its key (hash(key) % asee_shards), and
+ * returns len. A file that joins the consumer group with
+ * ASEE_IOC_JOIN_GROUP is given some of the shards, dealt again whenever a
+ * member joins or leaves (ASEE_IOC_LEAVE_GROUP, or close()). Its read()s
+ * then return one record at a time from its shards, so the records of a
+ * key are read in order by a single member. A record larger than the read
+ * fails with EMSGSIZE. ASEE_IOC_GET_SHARDS gives the bitmap of the shards
+ * of the file.
+ */
+struct asee_keyed_write {
+    __u64 buf;
+    __u64 key;
+    __u32 len;
+    __u32 pad;
+};
+
+#define ASEE_IOC_WRITE_KEYED _IOW(ASEE_IOC_MAGIC, 9, struct asee_keyed_write)
+#define ASEE_IOC_JOIN_GROUP _IO(ASEE_IOC_MAGIC, 10)
+#define ASEE_IOC_LEAVE_GROUP _IO(ASEE_IOC_MAGIC, 11)
+#define ASEE_IOC_GET_SHARDS _IOR(ASEE_IOC_MAGIC, 12, __u64)
+
+/* Status of the channel, in a read-only page mapped with mmap() at offset
+ * ASEE_MMAP_STATUS. It is refreshed every asee_status_us while mapped (at
+ * time_ns, CLOCK_MONOTONIC), so it can be polled without system calls. seq
+ * is odd during an update; read it as a seqcount:
+ *
+ *     do {
+ *         seq = st->seq;    (again while odd)
+ *         read barrier, copy the fields, read barrier
+ *     } while (st->seq != seq);
+ *
+ * fill is prod_tail - cons_tail, the bytes of lane 0; lanes_len and
+ * spill_len are the bytes of the priority lanes and of the spill file.
+ */
+#define ASEE_MMAP_STATUS (1ULL << 32)
+
+struct asee_status {
+    __u32 seq;
+    __u32 interval_us;
+    __u64 time_ns;
+    __u64 prod_tail;
+    __u64 cons_tail;
+    __u32 fill;
+    __u32 capacity;
+    __u32 ring_size;
+    __u32 read_waiters;
+    __u32 write_waiters;
+    __u32 policy;
+    __u64 bytes_read;
+    __u64 bytes_written;
+    __u64 reads;
+    __u64 dropped;
+    __u64 drop_events;
+    __u64 lanes_len;
+    __u64 spill_len;
+};
+
+#endif
@@ -0,0 +1,874 @@
+/*
+ * asee_torture.c - stress test of asee_mod, after rcutorture: writer and
+ * reader threads go through a channel while its ring is resized, they are
+ * sent signals and CPUs go offline and online. Every record carries its
+ * writer, its sequence number and a checksum; each one is checked as it is
+ * read, and at the end every record written must have been read once.
+ *
+ * Configured with module parameters, and reports to the kernel log every
+ * stat_interval seconds, ending with "End of test: SUCCESS" or "FAILURE".
+ * For unattended runs, in QEMU for instance:
+ *
+ *     modprobe asee_torture duration=600 onoff_ms=500 poweroff=1
+ *
+ * The channel must be given to the test alone, with the block policy (the
+ * default): other readers would take records, other policies drop them.
+ *
+ * A second channel, file_channel, gets one writer and one reader of its own
+ * that go through /dev/<file_channel> with kernel_write() and kernel_read(),
+ * so through read(), write() and their waits as user space does. A write
+ * may be taken in part, so records could not be checked there alongside
+ * the others. When a signal cuts one of them short, the thread closes the
+ * file and opens it again. Load asee_mod with nr_channels=2 at least:
+ *
+ *     insmod asee_mod.ko nr_channels=2
+ *     insmod asee_torture.ko file_channel=asee_mod1
+ */
+
+#include <linux/atomic.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h> /* for sprintf() */
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/printk.h>
+#include <linux/random.h>
+#include <linux/reboot.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/version.h>
+
+#include "asee_kernel.h"
+
+#define ASEE_TORTURE_MAGIC 0x61736565 /* "asee" */
+/* Largest record */
+#define ASEE_TORTURE_REC_MAX (64 * 1024)
+/* Longest wait of a reader or writer, which then looks at
+ * kthread_should_stop()
+ */
+#define ASEE_TORTURE_WAIT_US (100 * USEC_PER_MSEC)
+/* Time the readers get to drain the channel once the writers stopped */
+#define ASEE_TORTURE_DRAIN_MS (10 * MSEC_PER_SEC)
+
+static char *channel = "asee_mod";
+module_param(channel, charp, 0444);
+MODULE_PARM_DESC(channel, "Channel to test (default asee_mod)");
+
+static char *file_channel = "asee_mod1";
+module_param(file_channel, charp, 0444);
+MODULE_PARM_DESC(file_channel, "Channel to test through its device file, "
+                 "empty for none (default asee_mod1)");
+
+static int nwriters = 4;
+module_param(nwriters, int, 0444);
+MODULE_PARM_DESC(nwriters, "Number of writer threads (default 4)");
+
+static int nreaders = 2;
+module_param(nreaders, int, 0444);
+MODULE_PARM_DESC(nreaders, "Number of reader threads (default 2)");
+
+static unsigned int rec_size = 64;
+module_param(rec_size, uint, 0444);
+MODULE_PARM_DESC(rec_size, "Size of the records, header included "
+                 "(default 64)");
+
+static unsigned int resize_ms = 100;
+module_param(resize_ms, uint, 0444);
+MODULE_PARM_DESC(resize_ms, "Milliseconds between two resizes of the ring, "
+                 "through asee_buf_size, 0 for none (default 100)");
+
+static unsigned int buf_min = 4096;
+module_param(buf_min, uint, 0444);
+MODULE_PARM_DESC(buf_min, "Smallest size given to the ring (default 4096)");
+
+static unsigned int buf_max = 1024 * 1024;
+module_param(buf_max, uint, 0444);
+MODULE_PARM_DESC(buf_max, "Largest size given to the ring (default 1 MiB)");
+
+static unsigned int signal_us = 1000;
+module_param(signal_us, uint, 0444);
+MODULE_PARM_DESC(signal_us, "Microseconds between two signals sent to a "
+                 "reader or writer, 0 for none (default 1000)");
+
+static unsigned int onoff_ms;
+module_param(onoff_ms, uint, 0444);
+MODULE_PARM_DESC(onoff_ms, "Milliseconds between two CPU hotplug operations, "
+                 "0 for none (default 0)");
+
+static unsigned int stat_interval = 10;
+module_param(stat_interval, uint, 0444);
+MODULE_PARM_DESC(stat_interval, "Seconds between two reports (default 10)");
+
+static unsigned int duration;
+module_param(duration, uint, 0444);
+MODULE_PARM_DESC(duration, "Seconds to run, 0 until unloaded (default 0)");
+
+static bool poweroff;
+module_param(poweroff, bool, 0444);
+MODULE_PARM_DESC(poweroff, "Power off at the end of the test (default 0)");
+
+/* Head of a record, followed by its payload, a function of both */
+struct asee_torture_hdr {
+    u32 magic;
+    u32 len;
+    u64 seq;
+    u32 writer;
+    u32 sum;
+};
+
+struct asee_torture_writer {
+    struct task_struct *task;
+    int id;
+    u64 seq;                  /* records written */
+    atomic_long_t received;   /* records read */
+    atomic64_t seq_sum;       /* of the records read */
+};
+
+struct asee_torture_reader {
+    struct task_struct *task;
+    u64 *next;                /* by writer, lowest sequence number to come */
+};
+
+/* The writer or the reader of file_channel */
+struct asee_torture_file {
+    struct task_struct *task;
+    bool stop;                /* finish the record and end */
+    bool done;
+    u64 records;              /* written, or read in sequence */
+};
+
+static struct asee_channel *chan;
+static bool file_pair;        /* file_channel is tested */
+static struct asee_torture_file fwriter, freader;
+static struct asee_torture_writer *writers;
+static struct asee_torture_reader *readers;
+static struct task_struct *resizer_task;
+static struct task_struct *signaller_task;
+static struct task_struct *onoff_task;
+static struct task_struct *stats_task;
+
+static DEFINE_MUTEX(torture_lock);
+static bool ended;
+static u64 start_ns;
+
+/* Failures */
+static atomic_long_t bad_records;     /* magic, writer or checksum */
+static atomic_long_t misordered;      /* older than one already read */
+static atomic_long_t short_records;   /* split across two peeks */
+static atomic_long_t errors;          /* unexpected errors of asee_mod */
+
+/* What the test did */
+static atomic_long_t records_read;
+static atomic_long_t waits;
+static atomic_long_t interrupted;     /* waits cut short by a signal */
+static atomic_long_t aborted;
+static atomic_long_t signals;
+static atomic_long_t resizes;
+static atomic_long_t resizes_refused; /* the ring held too much */
+static atomic_long_t offlines;
+static atomic_long_t onlines;
+static atomic_long_t onoff_failed;
+
+static u32 asee_torture_random(u32 n)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+    return get_random_u32_below(n);
+#else
+    return prandom_u32_max(n);
+#endif
+}
+
+/* Payload byte i of record seq of writer */
+static u8 asee_torture_byte(int writer, u64 seq, unsigned int i)
+{
+    return seq + i * 7 + writer;
+}
+
+static void asee_torture_fill(void *data, int writer, u64 seq)
+{
+    struct asee_torture_hdr hdr = {
+        .magic = ASEE_TORTURE_MAGIC,
+        .writer = writer,
+        .len = rec_size,
+        .seq = seq,
+    };
+    u8 *payload = data + sizeof(hdr);
+    unsigned int i;
+
+    for (i = 0; i < rec_size - sizeof(hdr); i++)
+        payload[i] = asee_torture_byte(writer, seq, i);
+    hdr.sum = jhash(payload, rec_size - sizeof(hdr), seq);
+    memcpy(data, &hdr, sizeof(hdr));
+}
+
+/* Check a record read by rd, and count it */
+static void asee_torture_check(struct asee_torture_reader *rd,
+                               const void *data, size_t len)
+{
+    struct asee_torture_hdr hdr;
+    struct asee_torture_writer *w;
+
+    if (len != rec_size) {
+        atomic_long_inc(&short_records);
+        return;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    if (hdr.magic != ASEE_TORTURE_MAGIC || hdr.writer >= (u32)nwriters ||
+        hdr.len != rec_size ||
+        hdr.sum != jhash(data + sizeof(hdr), rec_size - sizeof(hdr), hdr.seq)) {
+        if (atomic_long_inc_return(&bad_records) == 1)
+            pr_alert("asee_torture: bad record: magic %x writer %u len %u "
+                     "seq %llu\n", hdr.magic, hdr.writer, hdr.len, hdr.seq);
+        return;
+    }
+
+    /* A reader sees the records of a writer in the order they were
+     * written, with the gaps taken by the other readers.
+     */
+    if (hdr.seq < rd->next[hdr.writer]) {
+        if (atomic_long_inc_return(&misordered) == 1)
+            pr_alert("asee_torture: writer %u: record %llu after %llu\n",
+                     hdr.writer, hdr.seq, rd->next[hdr.writer] - 1);
+    }
+    rd->next[hdr.writer] = hdr.seq + 1;
+
+    w = &writers[hdr.writer];
+    atomic_long_inc(&w->received);
+    atomic64_add(hdr.seq, &w->seq_sum);
+    atomic_long_inc(&records_read);
+}
+
+/* Wait for room (write) or data, which signals may cut short */
+static void asee_torture_wait(bool write)
+{
+    int error = asee_kernel_wait(chan, write, rec_size, ASEE_TORTURE_WAIT_US);
+
+    atomic_long_inc(&waits);
+    if (error == -ERESTARTSYS) {
+        atomic_long_inc(&interrupted);
+        flush_signals(current);
+    } else if (error == -ECONNABORTED) {
+        atomic_long_inc(&aborted);
+    } else if (error && error != -ETIME) {
+        atomic_long_inc(&errors);
+        msleep(10);
+    }
+}
+
+static int asee_torture_writer_fn(void *data)
+{
+    struct asee_torture_writer *w = data;
+    struct asee_resv r;
+    int error;
+
+    allow_signal(SIGUSR1);
+    while (!kthread_should_stop()) {
+        error = asee_reserve(chan, rec_size, false, &r);
+        if (!error) {
+            asee_torture_fill(r.data, w->id, w->seq);
+            asee_commit(chan, &r);
+            WRITE_ONCE(w->seq, w->seq + 1);
+            cond_resched();
+        } else if (error == -EAGAIN || error == -EMSGSIZE) {
+            /* Full, or for now smaller than a record */
+            asee_torture_wait(true);
+        } else {
+            if (atomic_long_inc_return(&errors) == 1)
+                pr_alert("asee_torture: asee_reserve: error %d\n", error);
+            msleep(10);
+        }
+    }
+    return 0;
+}
+
+static int asee_torture_reader_fn(void *data)
+{
+    struct asee_torture_reader *rd = data;
+    struct asee_resv r;
+    int error;
+
+    allow_signal(SIGUSR1);
+    while (!kthread_should_stop()) {
+        error = asee_peek(chan, rec_size, false, &r);
+        if (!error) {
+            asee_torture_check(rd, r.data, r.len);
+            asee_release(chan, &r);
+            cond_resched();
+        } else if (error == -EAGAIN) {
+            asee_torture_wait(false);
+        } else {
+            if (atomic_long_inc_return(&errors) == 1)
+                pr_alert("asee_torture: asee_peek: error %d\n", error);
+            msleep(10);
+        }
+    }
+    return 0;
+}
+
+/* Open the device file of file_channel, NULL (and counted) on error */
+static struct file *asee_torture_dev_open(int flags)
+{
+    struct file *file;
+    char path[64];
+
+    snprintf(path, sizeof(path), "/dev/%s", file_channel);
+    file = filp_open(path, flags, 0);
+    if (IS_ERR(file)) {
+        if (atomic_long_inc_return(&errors) == 1)
+            pr_alert("asee_torture: %s: error %ld\n", path, PTR_ERR(file));
+        msleep(10);
+        return NULL;
+    }
+    return file;
+}
+
+/* A read or write of the device file failed, or was cut short by a signal:
+ * then the file is closed, to be opened again by the thread.
+ */
+static void asee_torture_file_error(struct file **file, ssize_t n,
+                                    const char *op)
+{
+    if (n == -ERESTARTSYS || n == -EINTR) {
+        atomic_long_inc(&interrupted);
+        flush_signals(current);
+        filp_close(*file, NULL);
+        *file = NULL;
+    } else if (n == -ECONNABORTED) {
+        atomic_long_inc(&aborted);
+    } else {
+        if (atomic_long_inc_return(&errors) == 1)
+            pr_alert("asee_torture: %s: error %zd\n", op, n);
+        msleep(10);
+    }
+}
+
+/* Check a record read from the device file: the next one of fwriter */
+static void asee_torture_file_check(const void *data)
+{
+    struct asee_torture_hdr hdr;
+
+    memcpy(&hdr, data, sizeof(hdr));
+    if (hdr.magic != ASEE_TORTURE_MAGIC || hdr.writer != (u32)nwriters ||
+        hdr.len != rec_size ||
+        hdr.sum != jhash(data + sizeof(hdr), rec_size - sizeof(hdr), hdr.seq)) {
+        if (atomic_long_inc_return(&bad_records) == 1)
+            pr_alert("asee_torture: bad record in %s: magic %x writer %u "
+                     "len %u seq %llu\n", file_channel, hdr.magic,
+                     hdr.writer, hdr.len, hdr.seq);
+        return;
+    }
+    if (hdr.seq != freader.records) {
+        if (atomic_long_inc_return(&misordered) == 1)
+            pr_alert("asee_torture: %s: record %llu instead of %llu\n",
+                     file_channel, hdr.seq, freader.records);
+    }
+    WRITE_ONCE(freader.records, hdr.seq + 1);
+}
+
+/* Once done, wait for kthread_stop(), with the signals still coming */
+static void asee_torture_file_done(struct asee_torture_file *f)
+{
+    WRITE_ONCE(f->done, true);
+    while (!kthread_should_stop()) {
+        flush_signals(current);
+        schedule_timeout_interruptible(HZ);
+    }
+}
+
+static int asee_torture_fwriter_fn(void *data)
+{
+    u8 *rec = kmalloc(rec_size, GFP_KERNEL);
+    struct file *file = NULL;
+    unsigned int off = 0;
+    loff_t pos = 0;
+    ssize_t n;
+
+    allow_signal(SIGUSR1);
+    if (!rec)
+        atomic_long_inc(&errors);
+    /* A record begun is finished, or the reader would see it cut */
+    while (rec && (!READ_ONCE(fwriter.stop) ||
+                   (off && !atomic_long_read(&errors)))) {
+        if (!file) {
+            file = asee_torture_dev_open(O_WRONLY);
+            continue;
+        }
+        if (!off)
+            asee_torture_fill(rec, nwriters, fwriter.records);
+        n = kernel_write(file, rec + off, rec_size - off, &pos);
+        if (n > 0) {
+            off += n;
+            if (off == rec_size) {
+                off = 0;
+                WRITE_ONCE(fwriter.records, fwriter.records + 1);
+            }
+            cond_resched();
+        } else {
+            asee_torture_file_error(&file, n ? n : -EIO, "kernel_write");
+        }
+    }
+    if (file)
+        filp_close(file, NULL);
+    kfree(rec);
+    asee_torture_file_done(&fwriter);
+    return 0;
+}
+
+static int asee_torture_freader_fn(void *data)
+{
+    u8 *rec = kmalloc(rec_size, GFP_KERNEL);
+    struct file *file = NULL;
+    unsigned int off = 0;
+    loff_t pos = 0;
+    ssize_t n;
+
+    allow_signal(SIGUSR1);
+    if (!rec)
+        atomic_long_inc(&errors);
+    while (rec && !READ_ONCE(freader.stop)) {
+        if (!file) {
+            file = asee_torture_dev_open(O_RDONLY);
+            continue;
+        }
+        n = kernel_read(file, rec + off, rec_size - off, &pos);
+        if (n > 0) {
+            off += n;
+            if (off == rec_size) {
+                asee_torture_file_check(rec);
+                off = 0;
+            }
+            cond_resched();
+        } else {
+            asee_torture_file_error(&file, n ? n : -EIO, "kernel_read");
+        }
+    }
+    if (file)
+        filp_close(file, NULL);
+    kfree(rec);
+    asee_torture_file_done(&freader);
+    return 0;
+}
+
+/* Open the asee_buf_size file of the channel */
+static struct file *asee_torture_size_file(int flags)
+{
+    char path[64];
+
+    /* The first channel has its files at the top of mymodule */
+    if (!strcmp(channel, "asee_mod"))
+        snprintf(path, sizeof(path), "/sys/kernel/mymodule/asee_buf_size");
+    else
+        snprintf(path, sizeof(path), "/sys/kernel/mymodule/%s/asee_buf_size",
+                 channel);
+    return filp_open(path, flags, 0);
+}
+
+static int asee_torture_resize(struct file *file, unsigned int size)
+{
+    char buf[16];
+    loff_t pos = 0;
+    int len = snprintf(buf, sizeof(buf), "%u\n", size);
+    ssize_t n = kernel_write(file, buf, len, &pos);
+
+    return n < 0 ? n : 0;
+}
+
+/* Resize the ring, as user space would through sysfs, then put it back */
+static int asee_torture_resizer_fn(void *data)
+{
+    struct file *file = asee_torture_size_file(O_RDWR);
+    unsigned int size, saved = 0;
+    char buf[16] = "";
+    loff_t pos = 0;
+    int error;
+
+    if (IS_ERR(file)) {
+        pr_alert("asee_torture: asee_buf_size: error %ld\n", PTR_ERR(file));
+        atomic_long_inc(&errors);
+        while (!kthread_should_stop())
+            schedule_timeout_interruptible(HZ);
+        return 0;
+    }
+    if (kernel_read(file, buf, sizeof(buf) - 1, &pos) <= 0 ||
+        kstrtouint(strim(buf), 0, &saved))
+        saved = 0;
+
+    while (!kthread_should_stop()) {
+        schedule_timeout_interruptible(msecs_to_jiffies(resize_ms));
+        size = buf_min + asee_torture_random(buf_max - buf_min + 1);
+        error = asee_torture_resize(file, size);
+        if (!error) {
+            atomic_long_inc(&resizes);
+        } else if (error == -EBUSY) {
+            atomic_long_inc(&resizes_refused);
+        } else {
+            if (atomic_long_inc_return(&errors) == 1)
+                pr_alert("asee_torture: resize to %u: error %d\n", size,
+                         error);
+        }
+    }
+
+    /* The readers are still running, so it can be put back */
+    if (saved && asee_torture_resize(file, saved))
+        pr_warn("asee_torture: could not put asee_buf_size back to %u\n",
+                saved);
+    fput(file);
+    return 0;
+}
+
+/* Send SIGUSR1 to a reader or writer at random */
+static int asee_torture_signaller_fn(void *data)
+{
+    struct task_struct *task;
+    u32 i;
+
+    while (!kthread_should_stop()) {
+        usleep_range(signal_us, signal_us + signal_us / 4 + 1);
+        i = asee_torture_random(nwriters + nreaders + (file_pair ? 2 : 0));
+        if (i < nwriters)
+            task = writers[i].task;
+        else if (i < nwriters + nreaders)
+            task = readers[i - nwriters].task;
+        else
+            task = i == nwriters + nreaders ? fwriter.task : freader.task;
+        if (!task)
+            continue;
+        send_sig(SIGUSR1, task, 1);
+        atomic_long_inc(&signals);
+    }
+    return 0;
+}
+
+#ifdef CONFIG_HOTPLUG_CPU
+/* Take a CPU other than the first offline, or bring one back, at random.
+ * The ones it took offline are brought back at the end.
+ */
+static int asee_torture_onoff_fn(void *data)
+{
+    unsigned int cpu;
+    int error;
+
+    while (!kthread_should_stop()) {
+        schedule_timeout_interruptible(msecs_to_jiffies(onoff_ms));
+        if (nr_cpu_ids < 2)
+            continue;
+        cpu = 1 + asee_torture_random(nr_cpu_ids - 1);
+        if (!cpu_present(cpu))
+            continue;
+        if (cpu_online(cpu)) {
+            error = remove_cpu(cpu);
+            if (!error)
+                atomic_long_inc(&offlines);
+        } else {
+            error = add_cpu(cpu);
+            if (!error)
+                atomic_long_inc(&onlines);
+        }
+        if (error)
+            atomic_long_inc(&onoff_failed);
+    }
+
+    for_each_present_cpu(cpu)
+        if (!cpu_online(cpu) && !add_cpu(cpu))
+            atomic_long_inc(&onlines);
+    return 0;
+}
+#endif
+
+static u64 asee_torture_written(void)
+{
+    u64 sum = 0;
+    int i;
+
+    for (i = 0; i < nwriters; i++)
+        sum += READ_ONCE(writers[i].seq);
+    return sum;
+}
+
+static bool asee_torture_failed(void)
+{
+    return atomic_long_read(&bad_records) || atomic_long_read(&misordered) ||
+           atomic_long_read(&short_records) || atomic_long_read(&errors);
+}
+
+static void asee_torture_print(const char *tag)
+{
+    u64 elapsed_ms = div_u64(ktime_get_ns() - start_ns, NSEC_PER_MSEC);
+    long read = atomic_long_read(&records_read);
+
+    pr_alert("asee_torture: %s: %llu s: written %llu read %ld records/s %llu "
+             "bytes/s %llu | bad %ld misordered %ld short %ld errors %ld | "
+             "waits %ld interrupted %ld aborted %ld signals %ld | resizes "
+             "%ld refused %ld | offlines %ld onlines %ld failed %ld | file "
+             "written %llu read %llu\n",
+             tag, div_u64(elapsed_ms, MSEC_PER_SEC), asee_torture_written(),
+             read, elapsed_ms ? div64_u64(read * 1000ULL, elapsed_ms) : 0,
+             elapsed_ms ? div64_u64((u64)read * rec_size * 1000, elapsed_ms) : 0,
+             atomic_long_read(&bad_records), atomic_long_read(&misordered),
+             atomic_long_read(&short_records), atomic_long_read(&errors),
+             atomic_long_read(&waits), atomic_long_read(&interrupted),
+             atomic_long_read(&aborted), atomic_long_read(&signals),
+             atomic_long_read(&resizes), atomic_long_read(&resizes_refused),
+             atomic_long_read(&offlines), atomic_long_read(&onlines),
+             atomic_long_read(&onoff_failed), READ_ONCE(fwriter.records),
+             READ_ONCE(freader.records));
+}
+
+static void asee_torture_stop_task(struct task_struct **task)
+{
+    if (*task)
+        kthread_stop(*task);
+    *task = NULL;
+}
+
+/* The file threads may be asleep in read() or write(): a signal wakes them,
+ * until they see stop.
+ */
+static void asee_torture_stop_file(struct asee_torture_file *f)
+{
+    if (!f->task)
+        return;
+    WRITE_ONCE(f->stop, true);
+    while (!READ_ONCE(f->done)) {
+        send_sig(SIGUSR1, f->task, 1);
+        msleep(10);
+    }
+    asee_torture_stop_task(&f->task);
+}
+
+/*
+ * Stop the writers and the disturbances, let the readers drain the
+ * channel, then check that every record was read once. Called with
+ * torture_lock held.
+ */
+static void asee_torture_end(void)
+{
+    struct asee_torture_writer *w;
+    u64 n, expect;
+    int i, ms;
+
+    asee_torture_stop_task(&signaller_task);
+    asee_torture_stop_task(&onoff_task);
+    for (i = 0; i < nwriters; i++)
+        asee_torture_stop_task(&writers[i].task);
+    asee_torture_stop_file(&fwriter);
+    asee_torture_stop_task(&resizer_task);
+
+    for (ms = 0; ms < ASEE_TORTURE_DRAIN_MS; ms += 10) {
+        if (atomic_long_read(&records_read) + atomic_long_read(&bad_records) +
+            atomic_long_read(&short_records) >= asee_torture_written() &&
+            READ_ONCE(freader.records) >= fwriter.records)
+            break;
+        msleep(10);
+    }
+    for (i = 0; i < nreaders; i++)
+        asee_torture_stop_task(&readers[i].task);
+    asee_torture_stop_file(&freader);
+
+    if (freader.records != fwriter.records) {
+        pr_alert("asee_torture: %s: wrote %llu records, %llu read\n",
+                 file_channel, fwriter.records, freader.records);
+        atomic_long_inc(&errors);
+    }
+
+    for (i = 0; i < nwriters; i++) {
+        w = &writers[i];
+        n = w->seq;
+        expect = n ? n * (n - 1) / 2 : 0;
+        if (atomic_long_read(&w->received) != n ||
+            atomic64_read(&w->seq_sum) != expect) {
+            pr_alert("asee_torture: writer %d: wrote %llu records, %ld "
+                     "read, sequence sum %lld instead of %llu\n", i, n,
+                     atomic_long_read(&w->received),
+                     (s64)atomic64_read(&w->seq_sum), expect);
+            atomic_long_inc(&errors);
+        }
+    }
+
+    asee_torture_print("end");
+    pr_alert("asee_torture: --- End of test: %s\n",
+             asee_torture_failed() ? "FAILURE" : "SUCCESS");
+    ended = true;
+}
+
+/* Reports, and the end of the test after duration */
+static int asee_torture_stats_fn(void *data)
+{
+    u64 end_ns = start_ns + (u64)duration * NSEC_PER_SEC;
+    u64 next_ns = start_ns + (u64)stat_interval * NSEC_PER_SEC;
+
+    while (!kthread_should_stop()) {
+        schedule_timeout_interruptible(HZ);
+        if (ended)
+            continue;
+        if (duration && ktime_get_ns() >= end_ns) {
+            mutex_lock(&torture_lock);
+            if (!ended)
+                asee_torture_end();
+            mutex_unlock(&torture_lock);
+            if (poweroff)
+                kernel_power_off();
+        } else if (stat_interval && ktime_get_ns() >= next_ns) {
+            asee_torture_print("run");
+            next_ns += (u64)stat_interval * NSEC_PER_SEC;
+        }
+    }
+    return 0;
+}
+
+static void asee_torture_free(void)
+{
+    int i;
+
+    if (readers)
+        for (i = 0; i < nreaders; i++)
+            kfree(readers[i].next);
+    kfree(readers);
+    kfree(writers);
+}
+
+static int __init asee_torture_init(void)
+{
+    struct task_struct *task;
+    int i, error = 0;
+
+    if (nwriters < 1 || nreaders < 1 ||
+        rec_size < sizeof(struct asee_torture_hdr) ||
+        rec_size > ASEE_TORTURE_REC_MAX || !buf_min || buf_min > buf_max) {
+        pr_err("asee_torture: invalid parameters\n");
+        return -EINVAL;
+    }
+    chan = asee_channel_find(channel);
+    if (!chan) {
+        pr_err("asee_torture: no channel %s\n", channel);
+        return -ENODEV;
+    }
+    if (*file_channel && !strcmp(file_channel, channel)) {
+        pr_err("asee_torture: file_channel must not be the channel\n");
+        return -EINVAL;
+    }
+    file_pair = *file_channel && asee_channel_find(file_channel);
+    if (*file_channel && !file_pair)
+        pr_warn("asee_torture: no channel %s, its device file is not "
+                "tested\n", file_channel);
+#ifndef CONFIG_HOTPLUG_CPU
+    if (onoff_ms)
+        pr_warn("asee_torture: no CPU hotplug in this kernel, onoff_ms "
+                "ignored\n");
+#endif
+
+    writers = kcalloc(nwriters, sizeof(*writers), GFP_KERNEL);
+    readers = kcalloc(nreaders, sizeof(*readers), GFP_KERNEL);
+    if (!writers || !readers) {
+        asee_torture_free();
+        return -ENOMEM;
+    }
+    for (i = 0; i < nreaders; i++) {
+        readers[i].next = kcalloc(nwriters, sizeof(u64), GFP_KERNEL);
+        if (!readers[i].next) {
+            asee_torture_free();
+            return -ENOMEM;
+        }
+    }
+
+    start_ns = ktime_get_ns();
+    /* Readers first, so that the writers find someone to make room */
+    for (i = 0; i < nreaders && !error; i++) {
+        task = kthread_run(asee_torture_reader_fn, &readers[i],
+                           "asee_torture_r/%d", i);
+        if (IS_ERR(task))
+            error = PTR_ERR(task);
+        else
+            readers[i].task = task;
+    }
+    for (i = 0; i < nwriters && !error; i++) {
+        writers[i].id = i;
+        task = kthread_run(asee_torture_writer_fn, &writers[i],
+                           "asee_torture_w/%d", i);
+        if (IS_ERR(task))
+            error = PTR_ERR(task);
+        else
+            writers[i].task = task;
+    }
+    if (!error && file_pair) {
+        task = kthread_run(asee_torture_freader_fn, NULL, "asee_torture_fr");
+        error = PTR_ERR_OR_ZERO(task);
+        if (!error)
+            freader.task = task;
+    }
+    if (!error && file_pair) {
+        task = kthread_run(asee_torture_fwriter_fn, NULL, "asee_torture_fw");
+        error = PTR_ERR_OR_ZERO(task);
+        if (!error)
+            fwriter.task = task;
+    }
+    if (!error && resize_ms) {
+        task = kthread_run(asee_torture_resizer_fn, NULL, "asee_torture_rs");
+        error = PTR_ERR_OR_ZERO(task);
+        if (!error)
+            resizer_task = task;
+    }
+    if (!error && signal_us) {
+        task = kthread_run(asee_torture_signaller_fn, NULL,
+                           "asee_torture_sig");
+        error = PTR_ERR_OR_ZERO(task);
+        if (!error)
+            signaller_task = task;
+    }
+#ifdef CONFIG_HOTPLUG_CPU
+    if (!error && onoff_ms) {
+        task = kthread_run(asee_torture_onoff_fn, NULL, "asee_torture_onoff");
+        error = PTR_ERR_OR_ZERO(task);
+        if (!error)
+            onoff_task = task;
+    }
+#endif
+    if (!error) {
+        task = kthread_run(asee_torture_stats_fn, NULL, "asee_torture_stats");
+        error = PTR_ERR_OR_ZERO(task);
+        if (!error)
+            stats_task = task;
+    }
+
+    if (error) {
+        pr_err("asee_torture: could not start the threads: error %d\n",
+               error);
+        atomic_long_inc(&errors);
+        mutex_lock(&torture_lock);
+        asee_torture_end();
+        mutex_unlock(&torture_lock);
+        asee_torture_free();
+        return error;
+    }
+    pr_alert("asee_torture: channel %s, %d writers, %d readers, file "
+             "channel %s, records of %u bytes, resize_ms %u, signal_us %u, "
+             "onoff_ms %u, duration %u\n", channel, nwriters, nreaders,
+             file_pair ? file_channel : "none", rec_size, resize_ms,
+             signal_us, onoff_ms, duration);
+    return 0;
+}
+
+static void __exit asee_torture_exit(void)
+{
+    asee_torture_stop_task(&stats_task);
+    mutex_lock(&torture_lock);
+    if (!ended)
+        asee_torture_end();
+    mutex_unlock(&torture_lock);
+    asee_torture_free();
+}
+
+module_init(asee_torture_init);
+module_exit(asee_torture_exit);
+
+MODULE_LICENSE("GPL");
@@ -6,9 +6,14 @@
 #include <linux/atomic.h>
 #include <linux/fs.h>
 #include <linux/kernel.h> /* for sprintf() */
+#include <linux/ktime.h>
+#include <linux/list.h>
 #include <linux/module.h> /* Specifically, a module */
 #include <linux/printk.h>
 #include <linux/proc_fs.h> /* Necessary because we use proc fs */
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/uaccess.h> /* for get_user and put_user */
 #include <linux/version.h>
@@ -28,37 +33,44 @@
 #define MESSAGE_LENGTH 80
 static char message[MESSAGE_LENGTH];
 
+/* When set, processes that open the file read-only share it, and only the
+ * ones that may write get it for themselves.
+ */
+static bool shared_readers;
+module_param(shared_readers, bool, 0644);
+MODULE_PARM_DESC(shared_readers, "Let read-only opens share the file");
+
+/* Statistics of the open gate, shown when the file is read */
+static struct {
+    u64 tickets;             /* tickets handed out so far */
+    unsigned long opens;
+    unsigned long waits;     /* opens that had to queue */
+    unsigned long handoffs;  /* wake-ups sent by the gate */
+    u64 wait_ns;             /* total time spent queued */
+    u64 max_wait_ns;
+    unsigned int depth;      /* processes queued right now */
+    unsigned int max_depth;
+} gate_stats;
+
 static struct proc_dir_entry *our_proc_file;
 #define PROC_ENTRY_FILENAME "sleep"
 
-/* Since we use the file operations struct, we can't use the special proc
- * output provisions - we have to use a standard read function, which is this
- * function.
+/* Output of the /proc file. It goes through seq_file, which keeps the
+ * position of each open file separately: concurrent readers do not see
+ * each other's end of file.
  */
-static ssize_t module_output(struct file *file, /* see include/linux/fs.h   */
-                             char __user *buf, /* The buffer to put data to
-                                                   (in the user segment)    */
-                             size_t len, /* The length of the buffer */
-                             loff_t *offset)
+static int module_show(struct seq_file *m, void *v)
 {
-    static int finished = 0;
-    int i;
-    char output_msg[MESSAGE_LENGTH + 30];
-
-    /* Return 0 to signify end of file - that we have nothing more to say
-     * at this point.
-     */
-    if (finished) {
-        finished = 0;
-        return 0;
-    }
-
-    sprintf(output_msg, "Last input:%s\n", message);
-    for (i = 0; i < len && output_msg[i]; i++)
-        put_user(output_msg[i], buf + i);
-
-    finished = 1;
-    return i; /* Return the number of bytes "read" */
+    seq_printf(m, "Last input:%s\n", message);
+    seq_printf(m, "tickets %llu opens %lu waits %lu handoffs %lu\n",
+               gate_stats.tickets, gate_stats.opens, gate_stats.waits,
+               gate_stats.handoffs);
+    seq_printf(m, "wait_us total %llu max %llu\n",
+               gate_stats.wait_ns / NSEC_PER_USEC,
+               gate_stats.max_wait_ns / NSEC_PER_USEC);
+    seq_printf(m, "queue depth %u max %u\n", gate_stats.depth,
+               gate_stats.max_depth);
+    return 0;
 }
 
 /* This function receives input from the user when the user writes to the
@@ -71,7 +83,7 @@ static ssize_t module_input(struct file *file, /* The file itself */
 {
     int i;
 
-    /* Put the input into Message, where module_output will later be able
+    /* Put the input into Message, where module_show will later be able
      * to use it.
      */
     for (i = 0; i < MESSAGE_LENGTH - 1 && i < length; i++)
@@ -83,22 +95,92 @@ static ssize_t module_input(struct file *file, /* The file itself */
     return i;
 }
 
-/* 1 if the file is currently open by somebody */
-static atomic_t already_open = ATOMIC_INIT(0);
+/*
+ * The file is guarded by a FIFO gate: a process that cannot open the file
+ * right away takes a ticket and waits in gate_queue, in ticket order. When
+ * the file is released, the gate itself lets the next ticket holder in, and
+ * wakes up that process only: nobody else wakes up to find the file taken
+ * again, and nobody can overtake a process already waiting.
+ *
+ * Everything below is protected by gate_lock.
+ */
+struct gate_waiter {
+    struct list_head list;
+    struct task_struct *task;
+    u64 ticket;
+    bool reader; /* shares the file with other readers */
+    bool granted;
+};
 
-/* Queue of processes who want our file */
-static DECLARE_WAIT_QUEUE_HEAD(waitq);
+static DEFINE_SPINLOCK(gate_lock);
+static LIST_HEAD(gate_queue);
+static unsigned int active_readers;
+static bool writer_active;
 
-/* Called when the /proc file is opened */
-static int module_open(struct inode *inode, struct file *file)
+static bool gate_may_enter(bool reader)
 {
-    /* If the file's flags include O_NONBLOCK, it means the process does not
-     * want to wait for the file. In this case, if the file is already open,
-     * we should fail with -EAGAIN, meaning "you will have to try again",
-     * instead of blocking a process which would rather stay awake.
+    if (writer_active)
+        return false;
+    return reader || !active_readers;
+}
+
+static void gate_enter(bool reader)
+{
+    if (reader)
+        active_readers++;
+    else
+        writer_active = true;
+    gate_stats.opens++;
+}
+
+/* Let in the processes at the head of the queue that may now enter: one
+ * writer, or a run of readers. Each one gets exactly one wake-up.
+ */
+static void gate_handoff(void)
+{
+    struct gate_waiter *w;
+
+    while (!list_empty(&gate_queue)) {
+        w = list_first_entry(&gate_queue, struct gate_waiter, list);
+        if (!gate_may_enter(w->reader))
+            break;
+        list_del(&w->list);
+        gate_stats.depth--;
+        gate_enter(w->reader);
+        gate_stats.handoffs++;
+        /* The waiter takes gate_lock before leaving, so w and its task
+         * stay valid until we release it.
+         */
+        smp_store_release(&w->granted, true);
+        wake_up_process(w->task);
+        if (!w->reader)
+            break;
+    }
+}
+
+static void gate_leave(bool reader)
+{
+    spin_lock(&gate_lock);
+    if (reader)
+        active_readers--;
+    else
+        writer_active = false;
+
+    /* Hand the file over to the next ticket holder(s), and wake up only
+     * them.
      */
-    if ((file->f_flags & O_NONBLOCK) && atomic_read(&already_open))
-        return -EAGAIN;
+    gate_handoff();
+    spin_unlock(&gate_lock);
+}
+
+/* Wait for our turn at the gate. Returns 0 or -EAGAIN/-EINTR. */
+static int gate_wait(struct file *file, bool reader)
+{
+    struct gate_waiter w = {
+        .task = current,
+        .reader = reader,
+    };
+    u64 start, waited;
 
     /* This is the correct place for try_module_get(THIS_MODULE) because if
      * a process is in the loop, which is within the kernel module,
@@ -106,56 +188,99 @@ static int module_open(struct inode *inode, struct file *file)
      */
     try_module_get(THIS_MODULE);
 
-    while (atomic_cmpxchg(&already_open, 0, 1)) {
-        int i, is_sig = 0;
+    spin_lock(&gate_lock);
+    if (list_empty(&gate_queue) && gate_may_enter(w.reader)) {
+        gate_enter(w.reader);
+        spin_unlock(&gate_lock);
+        return 0; /* Allow the access */
+    }
 
-        /* This function puts the current process, including any system
-         * calls, such as us, to sleep.  Execution will be resumed right
-         * after the function call, either because somebody called
-         * wake_up(&waitq) (only module_close does that, when the file
-         * is closed) or when a signal, such as Ctrl-C, is sent
-         * to the process
-         */
-        wait_event_interruptible(waitq, !atomic_read(&already_open));
+    /* If the file's flags include O_NONBLOCK, it means the process does not
+     * want to wait for the file. In this case, if the file is already open,
+     * we should fail with -EAGAIN, meaning "you will have to try again",
+     * instead of blocking a process which would rather stay awake.
+     */
+    if (file->f_flags & O_NONBLOCK) {
+        spin_unlock(&gate_lock);
+        module_put(THIS_MODULE);
+        return -EAGAIN;
+    }
 
-        /* If we woke up because we got a signal we're not blocking,
-         * return -EINTR (fail the system call).  This allows processes
-         * to be killed or stopped.
-         */
-        for (i = 0; i < _NSIG_WORDS && !is_sig; i++)
-            is_sig = current->pending.signal.sig[i] & ~current->blocked.sig[i];
-
-        if (is_sig) {
-            /* It is important to put module_put(THIS_MODULE) here, because
-             * for processes where the open is interrupted there will never
-             * be a corresponding close. If we do not decrement the usage
-             * count here, we will be left with a positive usage count
-             * which we will have no way to bring down to zero, giving us
-             * an immortal module, which can only be killed by rebooting
-             * the machine.
-             */
-            module_put(THIS_MODULE);
-            return -EINTR;
-        }
+    w.ticket = gate_stats.tickets++;
+    list_add_tail(&w.list, &gate_queue);
+    gate_stats.waits++;
+    if (++gate_stats.depth > gate_stats.max_depth)
+        gate_stats.max_depth = gate_stats.depth;
+    spin_unlock(&gate_lock);
+
+    /* Sleep until module_close hands us the file, or a signal, such as
+     * Ctrl-C, is sent to the process.
+     */
+    start = ktime_get_ns();
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (smp_load_acquire(&w.granted) || signal_pending(current))
+            break;
+        schedule();
     }
+    __set_current_state(TASK_RUNNING);
+    waited = ktime_get_ns() - start;
+
+    spin_lock(&gate_lock);
+    gate_stats.wait_ns += waited;
+    if (waited > gate_stats.max_wait_ns)
+        gate_stats.max_wait_ns = waited;
+    if (w.granted) {
+        spin_unlock(&gate_lock);
+        return 0; /* Allow the access */
+    }
+
+    /* Interrupted: give up our ticket. The processes behind us may be
+     * able to enter now that we are out of their way.
+     */
+    list_del(&w.list);
+    gate_stats.depth--;
+    gate_handoff();
+    spin_unlock(&gate_lock);
+
+    /* It is important to put module_put(THIS_MODULE) here, because
+     * for processes where the open is interrupted there will never
+     * be a corresponding close. If we do not decrement the usage
+     * count here, we will be left with a positive usage count
+     * which we will have no way to bring down to zero, giving us
+     * an immortal module, which can only be killed by rebooting
+     * the machine.
+     */
+    module_put(THIS_MODULE);
+    return -EINTR;
+}
 
-    return 0; /* Allow the access */
+/* Called when the /proc file is opened */
+static int module_open(struct inode *inode, struct file *file)
+{
+    bool reader = READ_ONCE(shared_readers) && !(file->f_mode & FMODE_WRITE);
+    int ret;
+
+    ret = gate_wait(file, reader);
+    if (ret)
+        return ret;
+
+    /* The mode is chosen at open time: remember it for module_close */
+    ret = single_open(file, module_show, (void *)(unsigned long)reader);
+    if (ret) {
+        gate_leave(reader);
+        module_put(THIS_MODULE);
+    }
+    return ret;
 }
 
 /* Called when the /proc file is closed */
 static int module_close(struct inode *inode, struct file *file)
 {
-    /* Set already_open to zero, so one of the processes in the waitq will
-     * be able to set already_open back to one and to open the file. All
-     * the other processes will be called when already_open is back to one,
-     * so they'll go back to sleep.
-     */
-    atomic_set(&already_open, 0);
+    struct seq_file *m = file->private_data;
 
-    /* Wake up all the processes in waitq, so if anybody is waiting for the
-     * file, they can have it.
-     */
-    wake_up(&waitq);
+    gate_leave((unsigned long)m->private);
+    single_release(inode, file);
 
     module_put(THIS_MODULE);
 
@@ -172,19 +297,19 @@ static int module_close(struct inode *inode, struct file *file)
  */
 #ifdef HAVE_PROC_OPS
 static const struct proc_ops file_ops_4_our_proc_file = {
-    .proc_read = module_output, /* "read" from the file */
+    .proc_read = seq_read, /* "read" from the file */
     .proc_write = module_input, /* "write" to the file */
     .proc_open = module_open, /* called when the /proc file is opened */
     .proc_release = module_close, /* called when it's closed */
-    .proc_lseek = noop_llseek, /* return file->f_pos */
+    .proc_lseek = seq_lseek,
 };
 #else
 static const struct file_operations file_ops_4_our_proc_file = {
-    .read = module_output,
+    .read = seq_read,
     .write = module_input,
     .open = module_open,
     .release = module_close,
-    .llseek = noop_llseek,
+    .llseek = seq_lseek,
 };
 #endif
 
@@ -206,7 +331,7 @@ static int __init sleep_init(void)
 }
 
 /* Cleanup - unregister our file from /proc.  This could get dangerous if
- * there are still processes waiting in waitq, because they are inside our
+ * there are still processes waiting in gate_queue, because they are inside our
  * open function, which will get unloaded. I'll explain how to avoid removal
  * of a kernel module in such a case in chapter 10.
  */